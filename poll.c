@@ -5,18 +5,87 @@
 NOTE: some poll events might not be defined by default unless you
 define a processor macro such as `_XOPEN_SOURCE` or `_GNU_SOURCE`
 before any `#include` directive.
+
+The Linux-specific modes (such as datagram relaying with `recvmmsg`) also
+need `_GNU_SOURCE` for their declarations, so they are only compiled in
+when it is defined on Linux.
+\*/
+
+/*\
+A strict C mode like `-std=c99` hides the POSIX declarations that the rest
+needs (`O_CLOEXEC`, `F_DUPFD_CLOEXEC`, `CLOCK_MONOTONIC`, ...), so unless
+one of these was picked already, this asks for POSIX 2008 with XSI.
 \*/
+#if !defined(_GNU_SOURCE) && !defined(_XOPEN_SOURCE) \
+ && !defined(_POSIX_C_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+
+#if defined(__linux__) && defined(_GNU_SOURCE)
+#define LINUX_EXTENSIONS
+#endif
 
 /* Standard C library headers */
 #include <errno.h> /* errno */
-#include <limits.h> /* INT_MAX */
-#include <stddef.h> /* size_t */
-#include <stdio.h> /* EOF, FILE, fputc, fputs, perror, stderr, stdout */
-#include <stdlib.h> /* calloc, qsort */
-#include <string.h> /* strlen, strcmp, strncmp */
+#include <limits.h> /* INT_MAX, LLONG_MAX */
+#include <signal.h> /* SIG*, kill, sigaddset, sigemptyset, sigset_t, ... */
+#include <stddef.h> /* offsetof, size_t */
+#include <stdint.h> /* int16_t, int32_t, int64_t, uint32_t, uint64_t */
+#include <stdio.h> /* EOF, FILE, fflush, fputc, fputs, fwrite, perror, ... */
+#include <stdlib.h> /* calloc, free, malloc, qsort, realloc */
+#include <string.h> /* memchr, memcpy, memmem, memset, strerror, strlen, ... */
 
 /* Standard UNIX/Linux (POSIX/SUS base) headers */
+#include <fcntl.h> /* F_*, FD_CLOEXEC, O_*, fcntl, open, struct flock */
 #include <poll.h> /* POLL*, nfds_t, poll, struct pollfd */
+#include <regex.h> /* REG_*, regcomp, regexec, regex_t */
+#include <spawn.h> /* posix_spawn, posix_spawn_file_actions_*, ... */
+#include <sys/mman.h> /* MAP_*, PROT_*, mmap, munmap */
+#include <sys/socket.h> /* AF_*, MSG_*, SO_TYPE, SOCK_*, connect, socket */
+#include <sys/stat.h> /* S_IS*, fstat, struct stat */
+#include <sys/types.h> /* pid_t, ssize_t */
+#include <sys/un.h> /* struct sockaddr_un */
+#include <sys/wait.h> /* WEXITSTATUS, WIFSIGNALED, WTERMSIG, waitid, ... */
+#include <time.h> /* CLOCK_MONOTONIC, clock_gettime, struct timespec */
+#include <unistd.h> /* close, dup3, ftruncate, pipe, pread, read, ... */
+
+#ifdef LINUX_EXTENSIONS
+#include <arpa/inet.h> /* inet_ntop, ntohs */
+#include <linux/sockios.h> /* SIOCOUTQ */
+#include <mqueue.h> /* mq_open */
+#include <netdb.h> /* freeaddrinfo, getaddrinfo, struct addrinfo */
+#include <netinet/in.h> /* INET6_ADDRSTRLEN, struct sockaddr_in(6) */
+#include <netinet/tcp.h> /* TCP_INFO, struct tcp_info */
+#include <pthread.h> /* pthread_create, pthread_join, pthread_t */
+#include <sys/inotify.h> /* IN_*, inotify_*, struct inotify_event */
+#include <sys/ioctl.h> /* FIONREAD, ioctl */
+#include <sys/signalfd.h> /* SFD_*, signalfd, struct signalfd_siginfo */
+#include <sys/syscall.h> /* SYS_* */
+#include <sys/timerfd.h> /* TFD_*, timerfd_create, timerfd_settime */
+#endif
+
+/* Compiler intrinsics */
+#ifdef __SSE2__
+#include <emmintrin.h> /* _mm_*, __m128i */
+#endif
+
+#if defined(LINUX_EXTENSIONS) && defined(SYS_pidfd_open)
+#define PID_SOURCES
+/* Older C libraries know waitid but not yet its pidfd ID type. */
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+#endif
+
+#ifdef LINUX_EXTENSIONS
+/*\
+Pseudo-events, which poll checks for itself. They use bits that no poll
+event uses (up to the sign bit of the short), and Linux ignores the bits
+of events that it doesn't know.
+\*/
+#define EVENT_DRAINED 0x4000
+#define EVENT_IDLE ((short)0x8000)
+#endif
 
 
 #define STRINGIFY(macro) STRINGIFY_(macro)
@@ -27,21 +96,104 @@ before any `#include` directive.
 #define EXIT_NO_EVENT 2
 #define EXIT_USAGE_ERROR 3
 #define EXIT_EXECUTION_ERROR 4
+#define EXIT_SPAWNED_FAILED 5
+
+#define DEFAULT_BATCH 32
+#define MAX_BATCH 1024
+#define MAX_DATAGRAM 65536
+#define MAX_LINE 4096
+/* path: room to read inotify events into at a time */
+#define INOTIFY_READ_SIZE 4096
+#define MAX_THREADS 1024
+/* Trace records to map into memory at a time (a whole number of pages) */
+#define TRACE_CHUNK_RECORDS 4096
+#define TRACE_MAGIC "polltrc1"
+/* --backend=auto: descriptors per thread when watching */
+#define AUTO_THREAD_DESCRIPTORS 16384
+/* connect: retry delays, in milliseconds */
+#define MIN_CONNECT_BACKOFF 5
+#define MAX_CONNECT_BACKOFF 100
+/* Conditions and --edge repeats: recheck delays, in milliseconds */
+#define MIN_RECHECK_DELAY 1
+#define MAX_RECHECK_DELAY 16
 
 
 char const version_text[] = "poll 1.1.1\n";
 
-char const help_text[] =
+/*\
+The help text is in parts, each short enough for any C99 compiler to take as
+one string literal, and printed one after another.
+\*/
+char const * const help_text[] =
+{
     "Wait until at least one event happens on at least one file descriptor.\n"
     "\n"
     "Usage:\n"
-    "    poll [--timeout=<ms>] [[<file descriptor>]... [<event>]...]...\n"
+    "    poll [<option>]... [[<file descriptor>]... [<event>]...]...\n"
     "    poll (--help | --version) [<ignored>]...\n"
     "\n"
     "Options:\n"
     "    -h --help          show this help text\n"
     "    -V --version       show version text\n"
     "    -t --timeout=<ms>  upper limit on waiting (in milliseconds)\n"
+    "    -s --spawn=<cmd>   run <cmd> with sh and report its output lines\n"
+    "    -w --watch         keep reporting events until <timeout> runs out\n"
+    "    -i --info          add details about each descriptor to its result\n"
+    "       --gather=<us>   after waking up, keep collecting events for up\n"
+    "                       to <us> microseconds and report them together\n"
+    "       --debounce=<ms> after reporting a descriptor, don't poll it for\n"
+    "                       <ms> milliseconds\n"
+    "       --max-rate=<lines>\n"
+    "                       write at most <lines> result lines per second,\n"
+    "                       muting descriptors over it until the next one\n"
+    "       --stats         write what the waiting took to stderr at the end\n"
+    "       --trace=<path>  add a binary record of every wake to <path>\n"
+    "       --decode-trace=<path>\n"
+    "                       print the records in <path> instead of waiting\n"
+    "       --summary       with --decode-trace, sum the records up instead\n"
+    "       --edge          only report a descriptor again once its events\n"
+    "                       have changed\n"
+    "       --retire=<event>[,<event>]...\n"
+    "                       stop polling a descriptor once it was reported\n"
+    "                       with one of these events, like HUP,NVAL,ERR\n"
+    "       --control=<fd>  read commands from <fd> while waiting: \"add\"\n"
+    "                       and then descriptors and events like in the\n"
+    "                       arguments, \"del <fd>...\", or \"timeout <ms>\"\n"
+    "       --min-ready=<count>\n"
+    "                       keep waiting until <count> descriptors have had\n"
+    "                       events that were asked for\n"
+    "       --all           keep waiting until all descriptors have had\n"
+    "                       events that were asked for\n"
+    "       --then[=<timeout>]\n"
+    "                       between arguments, starts another stage that is\n"
+    "                       waited for once the ones before it got events\n"
+    "                       that were asked for, with its own timeout\n"
+    "    -e --expression=<expression>\n"
+    "                       keep waiting until <expression> holds, like\n"
+    "                       \"(3:IN | 4:IN) & !5:HUP\", where each\n"
+    "                       <fd>:<event> is whether it was seen yet\n"
+#ifdef LINUX_EXTENSIONS
+    "    -r --relay         copy datagrams from ready sockets to stdout\n"
+    "       --batch=<count> datagrams to receive per system call (default "
+    STRINGIFY(DEFAULT_BATCH) ")\n"
+    "       --framing=<how> newline (default) or length datagram framing\n"
+    "       --address       prefix relayed datagrams with source address\n"
+    "       --threads=<count>\n"
+    "                       split the descriptors up between <count>\n"
+    "                       threads that wait for them at the same time\n"
+    "       --backend=<backend>\n"
+    "                       poll, threads, or auto (the default), which\n"
+    "                       uses threads for many thousands of descriptors\n"
+    "       --race=<fd>     race the connect: sources, and give the winner\n"
+    "                       to the spawned commands as <fd>\n"
+    "    -m --until-match=<pattern>\n"
+    "                       read from the descriptors polled for IN until\n"
+    "                       <pattern> shows up, and report it as MATCH\n"
+    "       --regex         <pattern> is an extended regular expression,\n"
+    "                       matched against each line\n"
+    "       --pass          copy what is read to stdout, instead of MATCH\n"
+#endif
+    ,
     "\n"
     "Exits:\n"
     "    " STRINGIFY(EXIT_ASKED_EVENT_OR_INFO)
@@ -54,6 +206,9 @@ char const help_text[] =
     "  error in how the poll command was called\n"
     "    " STRINGIFY(EXIT_EXECUTION_ERROR)
     "  error when trying to carry out the poll command\n"
+    "    " STRINGIFY(EXIT_SPAWNED_FAILED)
+    "  a spawned command exited with a non-zero status\n"
+    ,
     "\n"
     "Normal events:\n"
     "    IN OUT PRI"
@@ -79,7 +234,50 @@ char const help_text[] =
     "\n"
     "Always-polled events:\n"
     "    ERR HUP NVAL\n"
-;
+    ,
+#ifdef LINUX_EXTENSIONS
+    "\n"
+    "Conditions (on the events of the descriptors they are given with):\n"
+    "    IN>=<bytes>    IN only once at least <bytes> can be read\n"
+    "    OUT>=<bytes>   OUT only once at least <bytes> can be written\n"
+    "    DRAINED        once nothing is left queued in a pipe or socket for\n"
+    "                   its reader (checked with OUT as a hint)\n"
+    "    DRAINED<=<bytes>\n"
+    "                   once at most <bytes> are left queued\n"
+    "    IDLE:<ms>      once nothing new was readable for <ms>, and again\n"
+    "                   after every <ms> more of that\n"
+    "    IDLE:<ms>:discard\n"
+    "                   same, but reading and throwing away the data\n"
+    ,
+#endif
+    "\n"
+    "Sources (polled like file descriptors):\n"
+    "    fifo:<path>    named pipe, opened for reading without blocking\n"
+    "    unix:<path>    UNIX domain socket, connected to without blocking\n"
+#ifdef LINUX_EXTENSIONS
+    "    mq:<name>      POSIX message queue\n"
+#endif
+#ifdef PID_SOURCES
+    "    pid:<pid>      process, whose EXIT event is reported with its\n"
+    "                   exit status if it is a child of poll\n"
+#endif
+#ifdef LINUX_EXTENSIONS
+    "    sig:<sig>      signal (name or number), blocked and reported as IN\n"
+    "    timer:<ms>     repeating timer, reported as IN with expirations\n"
+    "    at:<ms>        timer expiring at a CLOCK_MONOTONIC time\n"
+    "    path:<path>    file, or directory if <path> ends with /, for which\n"
+    "                   the file events below are reported\n"
+    "    connect:unix:<path>, connect:tcp:<host>:<port>\n"
+    "                   connection, retried until something listens, and\n"
+    "                   reported as OUT once it is accepted\n"
+    "\n"
+    "File events:\n"
+    "    CREATE MODIFY CLOSE_WRITE CLOSE_NOWRITE OPEN ACCESS ATTRIB DELETE\n"
+    "    MOVED_FROM MOVED_TO\n"
+#endif
+    ,
+    0
+};
 
 struct event
 {
@@ -112,6 +310,10 @@ struct event const events[] =
 #ifdef POLLRDHUP
     {POLLRDHUP, "RDHUP"},
 #endif
+#ifdef LINUX_EXTENSIONS
+    {EVENT_DRAINED, "DRAINED"},
+    {EVENT_IDLE, "IDLE"},
+#endif
 /* result-only flags go at the bottom, so that command-line arguments are
 checked against them last - they are ignored in the "events" field on all
 systems as far as I know, so this code allows them to be set when polling by
@@ -123,6 +325,26 @@ inclusion in command-line */
 
 static const size_t event_count = sizeof(events) / sizeof(struct event);
 
+/*\
+Sources report some of the normal events under their own names, and those
+names can be used as aliases for the normal events when polling sources of
+the type with that prefix.
+\*/
+struct source_event
+{
+    short flag;
+    char const * name;
+    char const * prefix;
+};
+
+struct source_event const source_events[] =
+{
+#ifdef PID_SOURCES
+    {POLLIN, "EXIT", "pid:"},
+#endif
+    {0, "", 0}
+};
+
 
 static
 int error_need_descriptor_or_event(char * arg0)
@@ -136,11 +358,13 @@ int error_need_descriptor_or_event(char * arg0)
 
 
 static
-int error_need_timeout(char * arg0)
+int error_need_option_argument(char const * name, char * arg0)
 {
-    if(fputs(arg0, stderr) != EOF)
+    if(fputs(arg0, stderr) != EOF
+    && fputs(": need ", stderr) != EOF
+    && fputs(name, stderr) != EOF)
     {
-        fputs(": need timeout option argument\n", stderr);
+        fputs(" option argument\n", stderr);
     }
     return EXIT_USAGE_ERROR;
 }
@@ -160,11 +384,14 @@ int error_bad_option(char * option, char * arg0)
 
 
 static
-int error_bad_timeout(char * timeout, char * arg0)
+int error_bad_option_argument(char const * name, char * argument,
+                              char * arg0)
 {
     if(fputs(arg0, stderr) != EOF
-    && fputs(": bad timeout: ", stderr) != EOF
-    && fputs(timeout, stderr) != EOF)
+    && fputs(": bad ", stderr) != EOF
+    && fputs(name, stderr) != EOF
+    && fputs(": ", stderr) != EOF
+    && fputs(argument, stderr) != EOF)
     {
         fputc('\n', stderr);
     }
@@ -225,311 +452,7029 @@ int error_polling(char * arg0)
 
 
 static
-int print_help(char * arg0)
+int error_spawning(char const * command, char * arg0)
 {
-    if(fputs(help_text, stdout) != EOF
-    && fflush(stdout) != EOF)
+    int errno_ = errno;
+    if(fputs(arg0, stderr) != EOF
+    && fputs(": error spawning ", stderr) != EOF)
     {
-        return EXIT_ASKED_EVENT_OR_INFO;
+        errno = errno_;
+        perror(command);
     }
-    return error_writing_output(arg0);
+    return EXIT_EXECUTION_ERROR;
 }
 
 
 static
-int print_version(char * arg0)
+int error_opening(char const * source, char * arg0)
 {
-    if(fputs(version_text, stdout) != EOF
-    && fflush(stdout) != EOF)
+    int errno_ = errno;
+    if(fputs(arg0, stderr) != EOF
+    && fputs(": error opening ", stderr) != EOF)
     {
-        return EXIT_ASKED_EVENT_OR_INFO;
+        errno = errno_;
+        perror(source);
     }
-    return error_writing_output(arg0);
+    return EXIT_EXECUTION_ERROR;
 }
 
 
 static
-short parse_event(char const * string)
+int error_need_file_event(char const * source, char * arg0)
 {
-    static struct event const * const end = events + event_count;
-    struct event const * event = events;
-    for(; event < end; event += 1)
+    if(fputs(arg0, stderr) != EOF
+    && fputs(": need file events for ", stderr) != EOF
+    && fputs(source, stderr) != EOF)
     {
-        if(!strcmp(string, event->name))
-        {
-            return event->flag;
-        }
+        fputc('\n', stderr);
     }
-    return 0;
+    return EXIT_USAGE_ERROR;
 }
 
 
 static
-int parse_nonnegative_int(char const * string, int * destination)
+int error_tracing(char * arg0)
 {
-    int value = 0;
-    unsigned int character = *string;
-    do
+    int errno_ = errno;
+    if(fputs(arg0, stderr) != EOF)
     {
-        int digit;
-        if(character < '0' || character > '9')
-        {
-            return 0;
-        }
-        digit = character - '0';
-        if(value > (INT_MAX - digit) / 10)
-        {
-            return 0;
-        }
-        value = (value * 10) + digit;
+        errno = errno_;
+        perror(": error writing trace");
     }
-    while((character = *++string));
-    *destination = value;
-    return 1;
+    return EXIT_EXECUTION_ERROR;
 }
 
 
 static
-int fput_nonnegative_int(int value, FILE * stream)
+int error_bad_trace(char const * path, char * arg0)
 {
-    char buffer[sizeof(STRINGIFY(INT_MAX))];
-    char * string = buffer + sizeof(buffer);
-    *--string = '\0';
-    do
+    if(fputs(arg0, stderr) != EOF
+    && fputs(": bad trace file: ", stderr) != EOF
+    && fputs(path, stderr) != EOF)
     {
-        int digit = value % 10;
-        value /= 10;
-        *--string = digit + '0';
+        fputc('\n', stderr);
     }
-    while(value);
-    return fputs(string, stream);
+    return EXIT_EXECUTION_ERROR;
 }
 
 
 static
-int fput_result_line(int fd, short flags, FILE * stream)
+int error_trace_in_use(char const * path, char * arg0)
 {
-    static struct event const * const end = events + event_count;
-    struct event const * event = events;
-    if(fput_nonnegative_int(fd, stream) == EOF)
+    if(fputs(arg0, stderr) != EOF
+    && fputs(": trace file in use: ", stderr) != EOF
+    && fputs(path, stderr) != EOF)
     {
-        return EOF;
+        fputc('\n', stderr);
     }
-    for(; event < end; event += 1)
+    return EXIT_EXECUTION_ERROR;
+}
+
+
+static
+int error_waiting(char * arg0)
+{
+    int errno_ = errno;
+    if(fputs(arg0, stderr) != EOF)
     {
-        if(event->flag & flags)
-        {
-            if(fputc(' ', stream) == EOF
-            || fputs(event->name, stream) == EOF)
-            {
-                return EOF;
-            }
-        }
+        errno = errno_;
+        perror(": error waiting for child");
     }
-    return fputc('\n', stream);
+    return EXIT_EXECUTION_ERROR;
 }
 
 
 static
-void applyFlagsToFDGroup(short flags, nfds_t * nfds, nfds_t * fdGroup_i,
-                         struct pollfd * polls)
+int error_reading(char * arg0)
 {
-    /*\
-    If no prior FD arguments, increment nfds to use the default poll as this
-    FD group:
-    \*/
-    if(!*nfds)
+    int errno_ = errno;
+    if(fputs(arg0, stderr) != EOF)
     {
-        *nfds = 1;
+        errno = errno_;
+        perror(": error reading");
     }
-    /* Apply flags to FD group: */
-    for(; *fdGroup_i < *nfds; *fdGroup_i += 1)
+    return EXIT_EXECUTION_ERROR;
+}
+
+
+/*\
+Unlike the other errors, a bad control command does not end the run, so
+this has nothing to return.
+\*/
+static
+void error_bad_control_command(char const * command, char * arg0)
+{
+    if(fputs(arg0, stderr) != EOF
+    && fputs(": bad control command: ", stderr) != EOF
+    && fputs(command, stderr) != EOF)
     {
-        polls[*fdGroup_i].events = flags;
+        fputc('\n', stderr);
     }
 }
 
 
+#ifdef LINUX_EXTENSIONS
 static
-int pollfdcmp(void const * poll1, void const * poll2)
+int error_starting_threads(char * arg0)
 {
-    return ((struct pollfd * )poll1)->fd - ((struct pollfd * )poll2)->fd;
+    int errno_ = errno;
+    if(fputs(arg0, stderr) != EOF)
+    {
+        errno = errno_;
+        perror(": error starting threads");
+    }
+    return EXIT_EXECUTION_ERROR;
 }
 
 
 static
-nfds_t merge_sorted_polls(struct pollfd * polls, nfds_t count)
+int error_receiving(char * arg0)
 {
-    struct pollfd const * const end = polls + count;
-    struct pollfd * last_unique = polls;
-    struct pollfd const * next = polls + 1;
-    for(; next < end; next += 1)
+    int errno_ = errno;
+    if(fputs(arg0, stderr) != EOF)
     {
-        if(last_unique->fd == next->fd)
-        {
-            last_unique->events |= next->events;
-            count -= 1;
-        }
-        else
-        {
-            last_unique += 1;
-            *last_unique = *next;
-        }
+        errno = errno_;
+        perror(": error receiving datagrams");
     }
-    return count;
+    return EXIT_EXECUTION_ERROR;
 }
+#endif
 
 
-int main(int argc, char * * argv)
+static
+int print_help(char * arg0)
 {
-    char * arg;
-    char * arg0 = *argv;
-    char * timeout_arg = 0;
-    int timeout = -1;  /* default timeout is no timeout */
-    nfds_t nfds;
-
-    if(argc < 2)
+    char const * const * part = help_text;
+    for(; *part; part += 1)
     {
-        if(!arg0)
+        if(fputs(*part, stdout) == EOF)
         {
-            arg0 = "";
+            return error_writing_output(arg0);
         }
-        return error_need_descriptor_or_event(arg0);
     }
+    if(fflush(stdout) != EOF)
+    {
+        return EXIT_ASKED_EVENT_OR_INFO;
+    }
+    return error_writing_output(arg0);
+}
 
-    argv += 1;
-    arg = *argv;
- 
-    if(*arg == '-')
+
+static
+int print_version(char * arg0)
+{
+    if(fputs(version_text, stdout) != EOF
+    && fflush(stdout) != EOF)
     {
-        arg += 1;
-        if(!strcmp(arg, "-help") || !strcmp(arg, "h"))
-        {
-            return print_help(arg0);
-        }
-        if(!strcmp(arg, "-version") || !strcmp(arg, "V"))
-        {
-            return print_version(arg0);
-        }
+        return EXIT_ASKED_EVENT_OR_INFO;
+    }
+    return error_writing_output(arg0);
+}
+
+
+static
+int is_flag_option(char const * arg, char const * long_name, char short_name)
+{
+    if(arg[1] == '-')
+    {
+        return !strcmp(arg + 2, long_name);
+    }
+    return short_name && arg[1] == short_name && !arg[2];
+}
 
-        if(!strcmp(arg, "-timeout") || !strcmp(arg, "t"))
+
+static
+int is_value_option(char * * * argv, char const * long_name, char short_name,
+                    char * * value)
+{
+    char * arg = **argv;
+    if(arg[1] == '-')
+    {
+        size_t length = strlen(long_name);
+        if(strncmp(arg + 2, long_name, length))
         {
-            argv += 1;
-            arg = *argv;
-            if(!arg)
-            {
-                return error_need_timeout(arg0);
-            }
-            timeout_arg = arg;
+            return 0;
         }
-        else
-        if(!strncmp(arg, "-timeout=", 9))
+        arg += 2 + length;
+        if(*arg == '=')
         {
-            timeout_arg = arg + 9;
+            *value = arg + 1;
+            return 1;
         }
-        else
-        if(!strncmp(arg, "t", 1))
+        if(*arg)
         {
-            timeout_arg = arg + 1;
+            return 0;
         }
-        else
+    }
+    else
+    {
+        if(!short_name || arg[1] != short_name)
         {
-            return error_bad_option(arg - 1, arg0);
+            return 0;
         }
-
-        argv += 1;
-        arg = *argv;
-
-        if(!arg)
+        arg += 2;
+        if(*arg)
         {
-            return error_need_descriptor_or_event(arg0);
+            *value = arg;
+            return 1;
         }
     }
-
-    if(timeout_arg && !parse_nonnegative_int(timeout_arg, &timeout))
-    {
-        return error_bad_timeout(timeout_arg, arg0);
-    }
-
-    /* We always poll for at least one FD if we poll at all. */
-    nfds = argc;
- 
     /*\
-    This overallocates in most cases, but it is normal for calloc
-    to overallocate much more internally (one memory page or more).
+    The value is in the next argument, or missing if there is none - either
+    way, the caller sees the next argument through the value (null if none).
     \*/
-    struct pollfd * polls = calloc(nfds, sizeof(struct pollfd));
-    if(!polls)
+    *argv += 1;
+    *value = **argv;
+    return 1;
+}
+
+
+struct file_event
+{
+    uint32_t const flag;
+    char const * const name;
+};
+
+struct file_event const file_events[] =
+{
+#ifdef LINUX_EXTENSIONS
+    {IN_CREATE, "CREATE"},
+    {IN_MODIFY, "MODIFY"},
+    {IN_CLOSE_WRITE, "CLOSE_WRITE"},
+    {IN_CLOSE_NOWRITE, "CLOSE_NOWRITE"},
+    {IN_OPEN, "OPEN"},
+    {IN_ACCESS, "ACCESS"},
+    {IN_ATTRIB, "ATTRIB"},
+    {IN_DELETE, "DELETE"},
+    {IN_MOVED_FROM, "MOVED_FROM"},
+    {IN_MOVED_TO, "MOVED_TO"},
+/* When events are lost, this is reported for every path instead. */
+    {IN_Q_OVERFLOW, "OVERFLOW"},
+#endif
+    {0, 0}
+};
+
+
+static
+uint32_t parse_file_event(char const * string)
+{
+    struct file_event const * event = file_events;
+    for(; event->flag; event += 1)
+    {
+        if(!strcmp(string, event->name))
+        {
+            return event->flag;
+        }
+    }
+    return 0;
+}
+
+
+static
+short parse_event(char const * string)
+{
+    static struct event const * const end = events + event_count;
+    struct event const * event = events;
+    for(; event < end; event += 1)
+    {
+        if(!strcmp(string, event->name))
+        {
+            return event->flag;
+        }
+    }
+    return 0;
+}
+
+
+static
+struct source_event const * parse_source_event(char const * string)
+{
+    struct source_event const * event = source_events;
+    for(; event->flag; event += 1)
+    {
+        if(!strcmp(string, event->name))
+        {
+            return event;
+        }
+    }
+    return 0;
+}
+
+
+/* Parses comma-separated event names, like "HUP,NVAL,ERR". */
+static
+int parse_event_list(char const * string, short * flags)
+{
+    *flags = 0;
+    for(;;)
+    {
+        char name[16];
+        size_t length = strcspn(string, ",");
+        short flag;
+        if(length >= sizeof(name))
+        {
+            return 0;
+        }
+        memcpy(name, string, length);
+        name[length] = '\0';
+        flag = parse_event(name);
+        if(!flag)
+        {
+            return 0;
+        }
+        *flags |= flag;
+        if(!string[length])
+        {
+            return 1;
+        }
+        string += length + 1;
+    }
+}
+
+
+static
+int parse_nonnegative_long_long(char const * string, long long * destination)
+{
+    long long value = 0;
+    unsigned int character = *string;
+    do
+    {
+        int digit;
+        if(character < '0' || character > '9')
+        {
+            return 0;
+        }
+        digit = character - '0';
+        if(value > (LLONG_MAX - digit) / 10)
+        {
+            return 0;
+        }
+        value = (value * 10) + digit;
+    }
+    while((character = *++string));
+    *destination = value;
+    return 1;
+}
+
+
+static
+int parse_nonnegative_int(char const * string, int * destination)
+{
+    long long value;
+    if(!parse_nonnegative_long_long(string, &value) || value > INT_MAX)
+    {
+        return 0;
+    }
+    *destination = value;
+    return 1;
+}
+
+
+static
+int fput_nonnegative_int(int value, FILE * stream)
+{
+    char buffer[sizeof(STRINGIFY(INT_MAX))];
+    char * string = buffer + sizeof(buffer);
+    *--string = '\0';
+    do
+    {
+        int digit = value % 10;
+        value /= 10;
+        *--string = digit + '0';
+    }
+    while(value);
+    return fputs(string, stream);
+}
+
+
+static
+int fput_events(short flags, FILE * stream)
+{
+    static struct event const * const end = events + event_count;
+    struct event const * event = events;
+    for(; event < end; event += 1)
+    {
+        if(event->flag & flags)
+        {
+            if(fputc(' ', stream) == EOF
+            || fputs(event->name, stream) == EOF)
+            {
+                return EOF;
+            }
+        }
+    }
+    return 0;
+}
+
+
+static
+int fput_field(char const * name, int value, FILE * stream)
+{
+    if(fputc(' ', stream) == EOF
+    || fputs(name, stream) == EOF
+    || fputc('=', stream) == EOF)
+    {
+        return EOF;
+    }
+    return fput_nonnegative_int(value, stream);
+}
+
+
+#ifdef LINUX_EXTENSIONS
+static
+int fput_file_events(uint32_t flags, FILE * stream)
+{
+    struct file_event const * event = file_events;
+    for(; event->flag; event += 1)
+    {
+        if(event->flag & flags)
+        {
+            if(fputc(' ', stream) == EOF
+            || fputs(event->name, stream) == EOF)
+            {
+                return EOF;
+            }
+        }
+    }
+    return 0;
+}
+#endif
+
+
+static
+int fput_descriptor_type(struct stat const * status, int fd, FILE * stream)
+{
+    char const * type;
+    if(S_ISFIFO(status->st_mode))
+    {
+        type = "pipe";
+    }
+    else
+    if(S_ISSOCK(status->st_mode))
+    {
+        type = "socket";
+    }
+    else
+    if(S_ISCHR(status->st_mode))
+    {
+        type = isatty(fd) ? "tty" : "device";
+    }
+    else
+    if(S_ISREG(status->st_mode))
+    {
+        type = "file";
+    }
+    else
+    if(S_ISDIR(status->st_mode))
+    {
+        type = "directory";
+    }
+    else
+    {
+        /* Like the event and timer descriptors of Linux, with no type. */
+        return 0;
+    }
+    if(fputs(" type=", stream) == EOF)
+    {
+        return EOF;
+    }
+    return fputs(type, stream);
+}
+
+
+#ifdef LINUX_EXTENSIONS
+static
+int clamp_to_int(uint32_t value)
+{
+    return value > INT_MAX ? INT_MAX : value;
+}
+
+
+/* Indexed by the TCP_* states of Linux, which start at 1. */
+static char const * const tcp_states[] =
+{
+    "", "ESTABLISHED", "SYN_SENT", "SYN_RECV", "FIN_WAIT1", "FIN_WAIT2",
+    "TIME_WAIT", "CLOSE", "CLOSE_WAIT", "LAST_ACK", "LISTEN", "CLOSING"
+};
+
+
+static
+int fput_tcp_info(int fd, FILE * stream)
+{
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    int protocol;
+    socklen_t protocol_length = sizeof(protocol);
+    if(getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &protocol_length)
+    || protocol != IPPROTO_TCP
+    || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length))
+    {
+        return 0;
+    }
+    if(info.tcpi_state
+    && info.tcpi_state < sizeof(tcp_states) / sizeof(*tcp_states)
+    && (fputs(" state=", stream) == EOF
+       || fputs(tcp_states[info.tcpi_state], stream) == EOF))
+    {
+        return EOF;
+    }
+    if(fput_field("rtt_us", clamp_to_int(info.tcpi_rtt), stream) == EOF
+    || fput_field("unacked", clamp_to_int(info.tcpi_unacked), stream) == EOF
+    || fput_field("retransmits", clamp_to_int(info.tcpi_total_retrans),
+                  stream) == EOF)
+    {
+        return EOF;
+    }
+    return 0;
+}
+#endif
+
+
+/*\
+For --info, prints details about the descriptor after its events, as
+`name=value` fields: what type of file it is, how many bytes can be read
+from it right away, some of the connection state of TCP sockets, and last
+(because its text has spaces in it) the error that a socket reported ERR
+for. Details which don't apply or can't be had are left out.
+\*/
+static
+int fput_descriptor_info(int fd, short revents, FILE * stream)
+{
+    struct stat status;
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if(fstat(fd, &status))
+    {
+        return 0;
+    }
+    if(fput_descriptor_type(&status, fd, stream) == EOF)
+    {
+        return EOF;
+    }
+#ifdef LINUX_EXTENSIONS
+    {
+        int bytes;
+        if(!S_ISDIR(status.st_mode) && !ioctl(fd, FIONREAD, &bytes)
+        && fput_field("bytes", bytes, stream) == EOF)
+        {
+            return EOF;
+        }
+    }
+    if(S_ISSOCK(status.st_mode) && fput_tcp_info(fd, stream) == EOF)
+    {
+        return EOF;
+    }
+#endif
+    /* Getting the error of a socket also clears it. */
+    if(S_ISSOCK(status.st_mode) && revents & POLLERR
+    && !getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) && error)
+    {
+        if(fputs(" error=", stream) == EOF
+        || fputs(strerror(error), stream) == EOF)
+        {
+            return EOF;
+        }
+    }
+    return 0;
+}
+
+
+static
+int fput_result_line(int fd, short flags, int info, FILE * stream)
+{
+    if(fput_nonnegative_int(fd, stream) == EOF
+    || fput_events(flags, stream) == EOF
+    || (info && fput_descriptor_info(fd, flags, stream) == EOF))
+    {
+        return EOF;
+    }
+    return fputc('\n', stream);
+}
+
+
+static
+int set_descriptor_flag(int fd, int get, int set, int flag)
+{
+    int flags = fcntl(fd, get);
+    if(flags < 0)
+    {
+        return -1;
+    }
+    return fcntl(fd, set, flags | flag);
+}
+
+
+#ifdef LINUX_EXTENSIONS
+static
+int clear_descriptor_flag(int fd, int get, int set, int flag)
+{
+    int flags = fcntl(fd, get);
+    if(flags < 0)
+    {
+        return -1;
+    }
+    return fcntl(fd, set, flags & ~flag);
+}
+#endif
+
+
+/*\
+Moves the descriptor to the lowest free number no lower than minimum, and
+makes it close-on-exec. Descriptors that we open ourselves must not reuse
+numbers that are in the arguments - those are closed when that happens,
+and should be reported as NVAL instead of being confused with ours.
+\*/
+static
+int move_descriptor(int fd, int minimum)
+{
+    int moved;
+    if(fd >= minimum)
+    {
+        if(set_descriptor_flag(fd, F_GETFD, F_SETFD, FD_CLOEXEC) < 0)
+        {
+            return -1;
+        }
+        return fd;
+    }
+    moved = fcntl(fd, F_DUPFD_CLOEXEC, minimum);
+    close(fd);
+    return moved;
+}
+
+
+struct source;
+struct sources;
+
+struct source_type
+{
+    char const * const prefix;
+    /*\
+    Opens the descriptor for the source named by the rest of the argument,
+    and initializes the source-specific fields. Returns the descriptor, -1
+    with errno set if opening failed, or -2 if the name is bad.
+    \*/
+    int (* const open)(char const * name, struct source * source,
+                       struct sources * sources);
+    /*\
+    Takes in whatever the source has for us when it has events, and can
+    change the descriptor and events that the source is polled with. Returns
+    0 if the events should be reported, 1 if they should not (the source is
+    not done yet, so we should keep waiting), or -1 with errno set.
+    \*/
+    int (* const consume)(struct source * source, struct pollfd * poll,
+                          struct sources const * sources);
+    /* Prints the events of the source, in place of `fput_events`. */
+    int (* const fput)(struct source const * source, short revents,
+                       FILE * stream);
+    /*\
+    For sources which share one descriptor, reports all of them at once, in
+    place of fput, with what consume took in. Returns zero, or the exit code
+    of an error.
+    \*/
+    int (* const report)(struct sources const * sources, short revents,
+                         char * arg0);
+};
+
+
+struct source
+{
+    struct source_type const * type;
+    char const * label;
+    int fd;
+    /* Events the source always needs to be polled for, on top of any asked. */
+    short events;
+    /* The events asked for the source in the arguments. */
+    short asked;
+    /* pid: exit status, or -1 if unknown */
+    int status;
+    /* timer: and at: expirations since the last report */
+    uint64_t expirations;
+    /* path: watch descriptor (-1 if none) and the file events asked for */
+    int watch;
+    uint32_t file_flags;
+    /* path: file name within the watched directory, null for any */
+    char const * name;
+    /* connect: address, and milliseconds to wait before the next retry */
+    struct sockaddr * address;
+    socklen_t address_length;
+    int backoff;
+    /* connect: whether the descriptor is the socket, or what we wait on */
+    int connecting;
+};
+
+
+/*\
+Conditions on the events of a descriptor, beyond what poll itself can wait
+for. While a condition is not met, the events it is about are taken out of
+the poll, and put back to be checked again after a growing delay, so that
+a level-triggered event which is not enough yet doesn't keep waking us.
+\*/
+struct condition
+{
+    int fd;
+    /* IN>= bytes to be readable, and OUT>= space to write, or 0 for any */
+    int in_bytes;
+    int out_bytes;
+    /* DRAINED<= bytes left queued, -1 if DRAINED is not asked for */
+    int drained_bytes;
+    /* IDLE: milliseconds without activity, and whether to read the data */
+    int idle;
+    int discard;
+    /* IDLE: when the last activity was (0 until the first wait starts), and
+    how much was readable then */
+    long long active;
+    int readable;
+    /* Events polled for only as hints, not to be reported. */
+    short hints;
+    /* Events taken out of the poll until the recheck time. */
+    short held;
+    long long recheck;
+    /* Milliseconds to hold events for the next time they are not enough. */
+    int delay;
+};
+
+
+/* path: events read from the inotify descriptor, until they are reported */
+struct inotify_buffer
+{
+    char * bytes;
+    size_t length;
+    size_t size;
+};
+
+
+struct sources
+{
+    struct source * list;
+    unsigned int count;
+    /* Conditions, at most one for each descriptor. */
+    struct condition * conditions;
+    unsigned int condition_count;
+    /* The lowest descriptor number not used in the arguments. */
+    int minimum;
+    /* The signal mask from before signal sources blocked their signals. */
+    sigset_t mask;
+    /* The inotify descriptor shared by all path sources, -1 until needed. */
+    int inotify;
+    struct inotify_buffer * inotify_events;
+    /* Whether result lines get details about the descriptors (--info). */
+    int info;
+};
+
+
+/* For sources which don't need anything done about their events. */
+static
+int consume_nothing(struct source * source, struct pollfd * poll,
+                    struct sources const * sources)
+{
+    (void)source;
+    (void)poll;
+    (void)sources;
+    return 0;
+}
+
+
+static
+int fput_plain_source(struct source const * source, short revents,
+                      FILE * stream)
+{
+    (void)source;
+    return fput_events(revents, stream);
+}
+
+
+static
+int open_fifo_source(char const * name, struct source * source,
+                     struct sources * sources)
+{
+    (void)source;
+    (void)sources;
+    /*\
+    Opening a FIFO for reading normally blocks until there is a writer, but
+    without blocking it opens right away, and polls as readable once there
+    is data, or hung up once a writer has come and gone.
+    \*/
+    return open(name, O_RDONLY | O_NONBLOCK);
+}
+
+
+static
+int set_unix_address(struct sockaddr_un * address, char const * path)
+{
+    size_t length = strlen(path);
+    if(length >= sizeof(address->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, path, length);
+    return 0;
+}
+
+
+static
+int connect_unix_socket(char const * path, int type)
+{
+    struct sockaddr_un address;
+    int fd;
+    if(set_unix_address(&address, path) < 0)
+    {
+        return -1;
+    }
+    fd = socket(AF_UNIX, type, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(set_descriptor_flag(fd, F_GETFL, F_SETFL, O_NONBLOCK) < 0
+    || (connect(fd, (struct sockaddr * )&address, sizeof(address)) < 0
+       && errno != EINPROGRESS && errno != EAGAIN))
+    {
+        int errno_ = errno;
+        close(fd);
+        errno = errno_;
+        return -1;
+    }
+    return fd;
+}
+
+
+static
+int open_unix_source(char const * name, struct source * source,
+                     struct sources * sources)
+{
+    int fd;
+    (void)source;
+    (void)sources;
+    if(!*name)
+    {
+        return -2;
+    }
+    /*\
+    A non-blocking connect either finishes right away or is reported with
+    OUT once it finishes. Datagram sockets refuse stream connections, so
+    we try those next.
+    \*/
+    fd = connect_unix_socket(name, SOCK_STREAM);
+    if(fd < 0 && errno == EPROTOTYPE)
+    {
+        fd = connect_unix_socket(name, SOCK_DGRAM);
+    }
+    return fd;
+}
+
+
+#ifdef LINUX_EXTENSIONS
+static
+int open_message_queue_source(char const * name, struct source * source,
+                              struct sources * sources)
+{
+    mqd_t queue;
+    (void)source;
+    (void)sources;
+    if(*name != '/')
+    {
+        return -2;
+    }
+    /*\
+    On Linux, message queue descriptors are file descriptors, which poll as
+    readable when there are messages and writable when there is room. We
+    take whichever access we are allowed, so that both can be polled.
+    \*/
+    queue = mq_open(name, O_RDWR | O_NONBLOCK);
+    if(queue < 0 && errno == EACCES)
+    {
+        queue = mq_open(name, O_RDONLY | O_NONBLOCK);
+    }
+    if(queue < 0 && errno == EACCES)
+    {
+        queue = mq_open(name, O_WRONLY | O_NONBLOCK);
+    }
+    return queue;
+}
+#endif
+
+
+#ifdef PID_SOURCES
+static
+int open_pid_source(char const * name, struct source * source,
+                    struct sources * sources)
+{
+    (void)sources;
+    int pid;
+    if(!parse_nonnegative_int(name, &pid) || !pid)
+    {
+        return -2;
+    }
+    source->status = -1;
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+
+static
+int consume_pid_source(struct source * source, struct pollfd * poll,
+                       struct sources const * sources)
+{
+    siginfo_t info;
+    (void)sources;
+    if(!(poll->revents & POLLIN))
+    {
+        return 0;
+    }
+    /*\
+    Only our children can be waited for: for any other process, waitid fails
+    and the exit status stays unknown. WNOWAIT leaves the child waitable, in
+    case the same process is given more than once.
+    \*/
+    info.si_pid = 0;
+    if(!waitid(P_PIDFD, source->fd, &info, WEXITED | WNOHANG | WNOWAIT)
+    && info.si_pid)
+    {
+        source->status = info.si_status;
+        if(info.si_code != CLD_EXITED)
+        {
+            source->status += 128;
+        }
+    }
+    return 0;
+}
+
+
+static
+int fput_pid_source(struct source const * source, short revents,
+                    FILE * stream)
+{
+    /* When a process exits, its pidfd becomes readable and hung up. */
+    if(fput_events(revents & ~(POLLIN | POLLRDNORM | POLLHUP), stream) == EOF)
+    {
+        return EOF;
+    }
+    if(!(revents & POLLIN))
+    {
+        return 0;
+    }
+    if(fputs(" EXIT", stream) == EOF)
+    {
+        return EOF;
+    }
+    if(source->status < 0)
+    {
+        return 0;
+    }
+    if(fputc(' ', stream) == EOF)
+    {
+        return EOF;
+    }
+    return fput_nonnegative_int(source->status, stream);
+}
+#endif
+
+
+#ifdef LINUX_EXTENSIONS
+struct signal_name
+{
+    int const number;
+    char const * const name;
+};
+
+struct signal_name const signal_names[] =
+{
+    {SIGHUP, "HUP"},
+    {SIGINT, "INT"},
+    {SIGQUIT, "QUIT"},
+    {SIGUSR1, "USR1"},
+    {SIGUSR2, "USR2"},
+    {SIGPIPE, "PIPE"},
+    {SIGALRM, "ALRM"},
+    {SIGTERM, "TERM"},
+    {SIGCHLD, "CHLD"},
+    {SIGCONT, "CONT"},
+    {SIGTSTP, "TSTP"},
+    {SIGTTIN, "TTIN"},
+    {SIGTTOU, "TTOU"},
+    {SIGURG, "URG"},
+    {SIGWINCH, "WINCH"},
+    {0, 0}
+};
+
+
+static
+int parse_signal(char const * string)
+{
+    struct signal_name const * signal = signal_names;
+    int number;
+    if(parse_nonnegative_int(string, &number))
+    {
+        return number < NSIG ? number : 0;
+    }
+    if(!strncmp(string, "SIG", 3))
+    {
+        string += 3;
+    }
+    for(; signal->name; signal += 1)
+    {
+        if(!strcmp(string, signal->name))
+        {
+            return signal->number;
+        }
+    }
+    return 0;
+}
+
+
+static
+int open_signal_source(char const * name, struct source * source,
+                       struct sources * sources)
+{
+    sigset_t signals;
+    int signal = parse_signal(name);
+    (void)source;
+    (void)sources;
+    /* Signals that can't be blocked can't be read from a signalfd either. */
+    if(!signal || signal == SIGKILL || signal == SIGSTOP)
+    {
+        return -2;
+    }
+    sigemptyset(&signals);
+    sigaddset(&signals, signal);
+    /*\
+    The signal has to be blocked to be queued up for the signalfd, instead
+    of getting its default action (which is usually killing poll).
+    \*/
+    if(sigprocmask(SIG_BLOCK, &signals, 0) < 0)
+    {
+        return -1;
+    }
+    return signalfd(-1, &signals, SFD_NONBLOCK);
+}
+
+
+static
+int consume_signal_source(struct source * source, struct pollfd * poll,
+                          struct sources const * sources)
+{
+    struct signalfd_siginfo info;
+    (void)sources;
+    if(!(poll->revents & POLLIN))
+    {
+        return 0;
+    }
+    /* Dequeue the signal, so that polling again doesn't report it again. */
+    while(read(source->fd, &info, sizeof(info)) < 0)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        if(errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static
+int open_timer(char const * name, int flags, struct source * source)
+{
+    struct itimerspec timer = {{0, 0}, {0, 0}};
+    long long milliseconds;
+    int fd;
+    if(!parse_nonnegative_long_long(name, &milliseconds))
+    {
+        return -2;
+    }
+    timer.it_value.tv_sec = milliseconds / 1000;
+    timer.it_value.tv_nsec = milliseconds % 1000 * 1000000;
+    if(flags & TFD_TIMER_ABSTIME)
+    {
+        /* A zero time would disarm the timer instead of expiring it. */
+        if(!milliseconds)
+        {
+            timer.it_value.tv_nsec = 1;
+        }
+    }
+    else
+    {
+        if(!milliseconds)
+        {
+            return -2;
+        }
+        /*\
+        The kernel keeps to the original schedule when the timer repeats,
+        so the expirations do not drift with how long we take to wake up.
+        \*/
+        timer.it_interval = timer.it_value;
+    }
+    source->expirations = 0;
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(timerfd_settime(fd, flags, &timer, 0) < 0)
+    {
+        int errno_ = errno;
+        close(fd);
+        errno = errno_;
+        return -1;
+    }
+    return fd;
+}
+
+
+static
+int open_interval_timer_source(char const * name, struct source * source,
+                               struct sources * sources)
+{
+    (void)sources;
+    return open_timer(name, 0, source);
+}
+
+
+static
+int open_absolute_timer_source(char const * name, struct source * source,
+                               struct sources * sources)
+{
+    (void)sources;
+    return open_timer(name, TFD_TIMER_ABSTIME, source);
+}
+
+
+static
+int consume_timer_source(struct source * source, struct pollfd * poll,
+                         struct sources const * sources)
+{
+    (void)sources;
+    source->expirations = 0;
+    if(!(poll->revents & POLLIN))
+    {
+        return 0;
+    }
+    /* Reading the expiration count also resets it. */
+    while(read(source->fd, &source->expirations, sizeof(uint64_t)) < 0)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        if(errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static
+int fput_timer_source(struct source const * source, short revents,
+                      FILE * stream)
+{
+    uint64_t expirations = source->expirations;
+    if(fput_events(revents, stream) == EOF)
+    {
+        return EOF;
+    }
+    if(!expirations)
+    {
+        return 0;
+    }
+    if(expirations > INT_MAX)
+    {
+        expirations = INT_MAX;
+    }
+    if(fputc(' ', stream) == EOF)
+    {
+        return EOF;
+    }
+    return fput_nonnegative_int(expirations, stream);
+}
+
+
+static
+int open_path_source(char const * name, struct source * source,
+                     struct sources * sources)
+{
+    if(!*name)
+    {
+        return -2;
+    }
+    source->watch = -1;
+    source->name = name;
+    /* Path sources are polled for IN whatever normal events they got. */
+    source->events = POLLIN;
+    if(sources->inotify < 0)
+    {
+        int fd;
+        sources->inotify_events = calloc(1, sizeof(struct inotify_buffer));
+        if(!sources->inotify_events)
+        {
+            return -1;
+        }
+        fd = inotify_init1(IN_NONBLOCK);
+        if(fd < 0)
+        {
+            free(sources->inotify_events);
+            sources->inotify_events = 0;
+            return -1;
+        }
+        sources->inotify = move_descriptor(fd, sources->minimum);
+    }
+    return sources->inotify;
+}
+
+
+/*\
+Files are watched through the directory they are in, which also sees them
+being created, and the events for them are picked out by name. Paths which
+end with a slash are directories, for which events on any file are wanted.
+\*/
+static
+int watch_path(struct source * source, uint32_t flags, int inotify)
+{
+    char const * path = source->name;
+    char const * slash = strrchr(path, '/');
+    char * directory;
+    char * allocated = 0;
+    flags &= IN_ALL_EVENTS;
+    source->file_flags = flags;
+    /* Without file events, it could never be reported. */
+    if(!flags)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if(!slash)
+    {
+        directory = ".";
+        source->name = path;
+    }
+    else
+    if(!slash[1])
+    {
+        directory = (char * )path;
+        source->name = 0;
+    }
+    else
+    {
+        size_t length = slash > path ? (size_t)(slash - path) : 1;
+        directory = allocated = malloc(length + 1);
+        if(!directory)
+        {
+            return -1;
+        }
+        memcpy(directory, path, length);
+        directory[length] = '\0';
+        source->name = slash + 1;
+    }
+    /* Several paths can be in one directory, each adding its own events. */
+    source->watch = inotify_add_watch(inotify, directory, flags | IN_MASK_ADD);
+    free(allocated);
+    return source->watch;
+}
+
+
+static
+int fput_path_event(struct source const * source,
+                    struct inotify_event const * event, FILE * stream)
+{
+    if(fputs(source->label, stream) == EOF
+    || fput_file_events(event->mask & (source->file_flags | IN_Q_OVERFLOW),
+                        stream) == EOF)
+    {
+        return EOF;
+    }
+    if(!source->name && event->len)
+    {
+        if(fputc(' ', stream) == EOF
+        || fputs(event->name, stream) == EOF)
+        {
+            return EOF;
+        }
+    }
+    return fputc('\n', stream);
+}
+
+
+static
+int path_event_matches(struct source const * source,
+                       struct inotify_event const * event)
+{
+    if(event->mask & IN_Q_OVERFLOW)
+    {
+        return source->watch >= 0;
+    }
+    if(source->watch != event->wd || !(event->mask & source->file_flags))
+    {
+        return 0;
+    }
+    if(!source->name)
+    {
+        return 1;
+    }
+    return event->len && !strcmp(event->name, source->name);
+}
+
+
+/*\
+Reads all the queued inotify events, and keeps them for report_path_sources
+if any of them is for one of the paths. Otherwise the wake was only for
+other files in the watched directories, so there is nothing to report.
+\*/
+static
+int consume_path_sources(struct source * source, struct pollfd * poll,
+                         struct sources const * sources)
+{
+    struct inotify_buffer * buffer = sources->inotify_events;
+    struct source const * const end = sources->list + sources->count;
+    size_t offset = 0;
+    (void)source;
+    buffer->length = 0;
+    if(!(poll->revents & POLLIN))
+    {
+        return 0;
+    }
+    for(;;)
+    {
+        ssize_t count;
+        if(buffer->size - buffer->length < INOTIFY_READ_SIZE)
+        {
+            char * bytes = realloc(buffer->bytes,
+                                   buffer->size + INOTIFY_READ_SIZE);
+            if(!bytes)
+            {
+                return -1;
+            }
+            buffer->bytes = bytes;
+            buffer->size += INOTIFY_READ_SIZE;
+        }
+        count = read(sources->inotify, buffer->bytes + buffer->length,
+                     buffer->size - buffer->length);
+        if(count < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buffer->length += count;
+    }
+    /* Events are padded by the kernel, so the next one is always aligned. */
+    while(offset < buffer->length)
+    {
+        struct inotify_event const * event
+            = (void const * )(buffer->bytes + offset);
+        for(source = sources->list; source < end; source += 1)
+        {
+            if(source->fd == sources->inotify
+            && path_event_matches(source, event))
+            {
+                return 0;
+            }
+        }
+        offset += sizeof(struct inotify_event) + event->len;
+    }
+    return 1;
+}
+
+
+/*\
+Prints a result line for each path that a consumed event is for - so
+unlike other sources, a path can get more than one result line from one
+wait, with one file event per line.
+\*/
+static
+int report_path_sources(struct sources const * sources, short revents,
+                        char * arg0)
+{
+    struct inotify_buffer * buffer = sources->inotify_events;
+    struct source const * const end = sources->list + sources->count;
+    size_t offset = 0;
+    (void)revents;
+    while(offset < buffer->length)
+    {
+        struct inotify_event const * event
+            = (void const * )(buffer->bytes + offset);
+        struct source const * source = sources->list;
+        for(; source < end; source += 1)
+        {
+            if(source->fd == sources->inotify
+            && path_event_matches(source, event)
+            && fput_path_event(source, event, stdout) == EOF)
+            {
+                return error_writing_output(arg0);
+            }
+        }
+        offset += sizeof(struct inotify_event) + event->len;
+    }
+    buffer->length = 0;
+    return 0;
+}
+
+/*\
+connect: sources stand in for the usual loop of trying to connect and
+sleeping in between. The connect is non-blocking, so poll tells us with OUT
+when it is done, and SO_ERROR tells us how it went. While nothing listens
+yet, the descriptor of the source is instead something that tells us when
+to try again - an inotify watch for the directory when a UNIX domain socket
+does not exist yet, and otherwise a timer with a short, growing delay. Each
+new descriptor is put in place of the previous one under the same number,
+so the source stays where it was in the polls.
+\*/
+static
+int is_retryable_connect_error(int error)
+{
+    switch(error)
+    {
+    case EAGAIN:
+    case ECONNABORTED:
+    case ECONNREFUSED:
+    case ECONNRESET:
+    case EHOSTUNREACH:
+    case ENETUNREACH:
+    case ENOENT:
+    case ETIMEDOUT:
+        return 1;
+    }
+    return 0;
+}
+
+
+static
+int start_connect(struct source const * source)
+{
+    int fd = socket(source->address->sa_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(connect(fd, source->address, source->address_length) < 0
+    && errno != EINPROGRESS)
+    {
+        int errno_ = errno;
+        close(fd);
+        errno = errno_;
+        return -1;
+    }
+    return fd;
+}
+
+
+/*\
+Returns an inotify descriptor which becomes readable when something is
+created in the directory of the socket, or -1 if we can't watch it or the
+socket already exists (so a timer has to do).
+\*/
+static
+int watch_for_socket(struct sockaddr_un const * address)
+{
+    char directory[sizeof(address->sun_path)];
+    char * slash;
+    int fd;
+    memcpy(directory, address->sun_path, sizeof(directory));
+    slash = strrchr(directory, '/');
+    if(!slash)
+    {
+        strcpy(directory, ".");
+    }
+    else
+    {
+        slash[slash == directory] = '\0';
+    }
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    /* Checking after the watch is added, so that we can't miss it. */
+    if(inotify_add_watch(fd, directory, IN_CREATE | IN_MOVED_TO) < 0
+    || !access(address->sun_path, F_OK))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static
+int wait_to_retry_connect(struct source * source, int error)
+{
+    struct itimerspec timer;
+    int fd;
+    if(error == ENOENT && source->address->sa_family == AF_UNIX)
+    {
+        fd = watch_for_socket((struct sockaddr_un const * )source->address);
+        if(fd >= 0)
+        {
+            return fd;
+        }
+    }
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_nsec = source->backoff * 1000000L;
+    if(timerfd_settime(fd, 0, &timer, 0) < 0)
+    {
+        int errno_ = errno;
+        close(fd);
+        errno = errno_;
+        return -1;
+    }
+    source->backoff *= 2;
+    if(source->backoff > MAX_CONNECT_BACKOFF)
+    {
+        source->backoff = MAX_CONNECT_BACKOFF;
+    }
+    return fd;
+}
+
+
+/*\
+Starts connecting, or if that can't work yet, gets a descriptor to wait on
+before trying again. Returns the descriptor, or -1 with errno set.
+\*/
+static
+int connect_or_wait(struct source * source)
+{
+    int fd = start_connect(source);
+    source->connecting = fd >= 0;
+    if(fd < 0 && is_retryable_connect_error(errno))
+    {
+        return wait_to_retry_connect(source, errno);
+    }
+    return fd;
+}
+
+
+static
+int resolve_unix_address(char const * path, struct source * source)
+{
+    struct sockaddr_un * address;
+    if(!*path)
+    {
+        return -2;
+    }
+    address = malloc(sizeof(struct sockaddr_un));
+    if(!address)
+    {
+        return -1;
+    }
+    if(set_unix_address(address, path) < 0)
+    {
+        free(address);
+        return -1;
+    }
+    source->address = (struct sockaddr * )address;
+    source->address_length = sizeof(struct sockaddr_un);
+    return 0;
+}
+
+
+/* Resolves <host>:<port>, where the host can be an IPv6 address in []. */
+static
+int resolve_tcp_address(char const * name, struct source * source)
+{
+    struct addrinfo hints;
+    struct addrinfo * result;
+    char * copy;
+    char * host;
+    char * port;
+    size_t length;
+    int error;
+    copy = malloc(strlen(name) + 1);
+    if(!copy)
+    {
+        return -1;
+    }
+    host = strcpy(copy, name);
+    port = strrchr(host, ':');
+    if(!port || port == host || !port[1])
+    {
+        free(copy);
+        return -2;
+    }
+    *port++ = '\0';
+    length = strlen(host);
+    if(*host == '[' && host[length - 1] == ']')
+    {
+        host[length - 1] = '\0';
+        host += 1;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    error = getaddrinfo(host, port, &hints, &result);
+    free(copy);
+    if(error == EAI_SYSTEM)
+    {
+        return -1;
+    }
+    if(error == EAI_MEMORY)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if(error)
+    {
+        return -2;
+    }
+    source->address = malloc(result->ai_addrlen);
+    if(!source->address)
+    {
+        freeaddrinfo(result);
+        return -1;
+    }
+    memcpy(source->address, result->ai_addr, result->ai_addrlen);
+    source->address_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+
+static
+int open_connect_source(char const * name, struct source * source,
+                        struct sources * sources)
+{
+    int fd;
+    (void)sources;
+    if(!strncmp(name, "unix:", 5))
+    {
+        fd = resolve_unix_address(name + 5, source);
+    }
+    else
+    if(!strncmp(name, "tcp:", 4))
+    {
+        fd = resolve_tcp_address(name + 4, source);
+    }
+    else
+    {
+        return -2;
+    }
+    if(fd < 0)
+    {
+        return fd;
+    }
+    source->backoff = MIN_CONNECT_BACKOFF;
+    fd = connect_or_wait(source);
+    source->events = source->connecting ? POLLOUT : POLLIN;
+    return fd;
+}
+
+
+static
+int consume_connect_source(struct source * source, struct pollfd * poll,
+                           struct sources const * sources)
+{
+    int fd;
+    (void)sources;
+    if(source->connecting)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if(!(poll->revents & (POLLOUT | POLLERR | POLLHUP)))
+        {
+            return 0;
+        }
+        if(getsockopt(source->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+        {
+            return -1;
+        }
+        if(!error)
+        {
+            return 0;
+        }
+        if(!is_retryable_connect_error(error))
+        {
+            poll->revents = POLLERR;
+            return 0;
+        }
+        fd = wait_to_retry_connect(source, error);
+        source->connecting = 0;
+    }
+    else
+    {
+        union
+        {
+            struct inotify_event event;
+            char bytes[4096];
+        }
+        buffer;
+        /* Whatever the timer or inotify has for us, it's time to retry. */
+        while(read(source->fd, buffer.bytes, sizeof(buffer)) > 0);
+        fd = connect_or_wait(source);
+    }
+    if(fd < 0)
+    {
+        /* We can't go on, so the error is reported, and never polled for. */
+        poll->revents = POLLERR;
+        poll->events = 0;
+        return 0;
+    }
+    if(dup3(fd, source->fd, O_CLOEXEC) < 0)
+    {
+        int errno_ = errno;
+        close(fd);
+        errno = errno_;
+        return -1;
+    }
+    close(fd);
+    poll->events = source->connecting ? source->asked | POLLOUT : POLLIN;
+    return 1;
+}
+#endif
+
+
+struct source_type const source_types[] =
+{
+    {"fifo:", open_fifo_source, consume_nothing, fput_plain_source, 0},
+    {"unix:", open_unix_source, consume_nothing, fput_plain_source, 0},
+#ifdef LINUX_EXTENSIONS
+    {"mq:", open_message_queue_source, consume_nothing, fput_plain_source,
+     0},
+#endif
+#ifdef PID_SOURCES
+    {"pid:", open_pid_source, consume_pid_source, fput_pid_source, 0},
+#endif
+#ifdef LINUX_EXTENSIONS
+    {"sig:", open_signal_source, consume_signal_source, fput_plain_source,
+     0},
+    {"timer:", open_interval_timer_source, consume_timer_source,
+     fput_timer_source, 0},
+    {"at:", open_absolute_timer_source, consume_timer_source,
+     fput_timer_source, 0},
+    {"path:", open_path_source, consume_path_sources, 0,
+     report_path_sources},
+    {"connect:", open_connect_source, consume_connect_source,
+     fput_plain_source, 0},
+#endif
+    {0, 0, 0, 0, 0}
+};
+
+
+static
+struct source_type const * find_source_type(char const * arg)
+{
+    struct source_type const * type = source_types;
+    for(; type->prefix; type += 1)
+    {
+        if(!strncmp(arg, type->prefix, strlen(type->prefix)))
+        {
+            return type;
+        }
+    }
+    return 0;
+}
+
+
+static
+struct source * find_source(struct sources const * sources, int fd)
+{
+    struct source * source = sources->list;
+    struct source * const end = source + sources->count;
+    for(; source < end; source += 1)
+    {
+        if(source->fd == fd)
+        {
+            return source;
+        }
+    }
+    return 0;
+}
+
+
+/*\
+Returns the descriptor of the newly opened source, -1 with errno set if
+opening it failed, or -2 if the source argument is bad.
+\*/
+static
+int open_source(struct source_type const * type, char * arg,
+                struct sources * sources)
+{
+    struct source * source = sources->list + sources->count;
+    int fd = type->open(arg + strlen(type->prefix), source, sources);
+    if(fd < 0)
+    {
+        return fd;
+    }
+    fd = move_descriptor(fd, sources->minimum);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    source->type = type;
+    source->label = arg;
+    source->fd = fd;
+    sources->count += 1;
+    return fd;
+}
+
+
+static
+int first_unused_descriptor(char * * argv)
+{
+    int minimum = 0;
+    for(; *argv; argv += 1)
+    {
+        int fd;
+        if(parse_nonnegative_int(*argv, &fd) && fd >= minimum)
+        {
+            minimum = fd + 1;
+        }
+    }
+    return minimum;
+}
+
+
+/*\
+Lets the source of a poll that has events take them in, if it has one.
+Returns zero, -1 if the source had nothing to report yet, or the exit code
+of an error.
+\*/
+static
+int consume_poll(struct pollfd * poll, struct sources const * sources,
+                 char * arg0)
+{
+    int status;
+    struct source * source = find_source(sources, poll->fd);
+    if(!source)
+    {
+        return 0;
+    }
+    status = source->type->consume(source, poll, sources);
+    if(status < 0)
+    {
+        return error_reading(arg0);
+    }
+    if(status)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*\
+Prints the result line for a poll that has events, under the label of its
+source if it has one. Returns zero, or the exit code of an error.
+\*/
+static
+int print_poll(struct pollfd const * poll, struct sources const * sources,
+               char * arg0)
+{
+    struct source * source = find_source(sources, poll->fd);
+    if(!source)
+    {
+        if(fput_result_line(poll->fd, poll->revents, sources->info, stdout)
+           == EOF)
+        {
+            return error_writing_output(arg0);
+        }
+        return 0;
+    }
+    if(source->type->report)
+    {
+        return source->type->report(sources, poll->revents, arg0);
+    }
+    if(fputs(source->label, stdout) == EOF
+    || source->type->fput(source, poll->revents, stdout) == EOF
+    || (sources->info
+       && fput_descriptor_info(poll->fd, poll->revents, stdout) == EOF)
+    || fputc('\n', stdout) == EOF)
+    {
+        return error_writing_output(arg0);
+    }
+    return 0;
+}
+
+
+/*\
+Reports a poll that has events. Returns zero, -1 if the source had nothing
+to report yet, or the exit code of an error.
+\*/
+static
+int report_poll(struct pollfd * poll, struct sources const * sources,
+                char * arg0)
+{
+    int error = consume_poll(poll, sources, arg0);
+    if(error)
+    {
+        return error;
+    }
+    return print_poll(poll, sources, arg0);
+}
+
+
+/*\
+Adds the watches for the path sources in the group - those are the sources
+which share the inotify descriptor. Returns the source it failed for, with
+errno set, or null on success. A path source fails without file events.
+\*/
+static
+struct source * watch_path_group(uint32_t flags, unsigned int * sourceGroup_i,
+                                 struct sources * sources)
+{
+    for(; *sourceGroup_i < sources->count; *sourceGroup_i += 1)
+    {
+        struct source * source = sources->list + *sourceGroup_i;
+        if(source->fd != sources->inotify)
+        {
+            continue;
+        }
+#ifdef LINUX_EXTENSIONS
+        if(watch_path(source, flags, sources->inotify) < 0)
+        {
+            return source;
+        }
+#else
+        (void)flags;
+#endif
+    }
+    return 0;
+}
+
+
+static
+int error_watching(struct source const * source, char * arg0)
+{
+    if(!source->file_flags)
+    {
+        return error_need_file_event(source->label, arg0);
+    }
+    return error_opening(source->label, arg0);
+}
+
+
+/* Whether a source event alias fits every descriptor in the group. */
+static
+int is_source_event_group(struct source_event const * event,
+                          struct pollfd const * polls, nfds_t from, nfds_t to,
+                          struct sources const * sources)
+{
+    if(from == to)
+    {
+        return 0;
+    }
+    for(; from < to; from += 1)
+    {
+        struct source const * source = find_source(sources, polls[from].fd);
+        if(!source || strcmp(source->type->prefix, event->prefix))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static
+void applyFlagsToFDGroup(short flags, nfds_t * nfds, nfds_t * fdGroup_i,
+                         struct pollfd * polls)
+{
+    /*\
+    If no prior FD arguments, increment nfds to use the default poll as this
+    FD group:
+    \*/
+    if(!*nfds)
+    {
+        *nfds = 1;
+    }
+    /* Apply flags to FD group: */
+    for(; *fdGroup_i < *nfds; *fdGroup_i += 1)
+    {
+        polls[*fdGroup_i].events = flags;
+    }
+}
+
+
+#ifdef LINUX_EXTENSIONS
+static
+int parse_idle_condition(char const * arg, struct condition * condition)
+{
+    char digits[sizeof(STRINGIFY(INT_MAX))];
+    char const * end = strchr(arg, ':');
+    size_t length = end ? (size_t)(end - arg) : strlen(arg);
+    if(length >= sizeof(digits) || (end && strcmp(end, ":discard")))
+    {
+        return -1;
+    }
+    memcpy(digits, arg, length);
+    digits[length] = '\0';
+    if(!parse_nonnegative_int(digits, &condition->idle) || !condition->idle)
+    {
+        return -1;
+    }
+    condition->discard = !!end;
+    return 1;
+}
+
+
+/*\
+Parses a condition argument into the condition for a group, and the event
+that it is on. Returns 1 if it is a condition, 0 if it is not, or -1 if it
+is one but its value is bad.
+\*/
+static
+int parse_condition(char const * arg, struct condition * condition,
+                    short * event)
+{
+    int bytes;
+    int * destination;
+    if(!strncmp(arg, "IDLE", 4))
+    {
+        *event = EVENT_IDLE;
+        if(arg[4] != ':')
+        {
+            return -1;
+        }
+        return parse_idle_condition(arg + 5, condition);
+    }
+    if(!strncmp(arg, "IN>=", 4))
+    {
+        destination = &condition->in_bytes;
+        *event = POLLIN;
+        arg += 4;
+    }
+    else
+    if(!strncmp(arg, "OUT>=", 5))
+    {
+        destination = &condition->out_bytes;
+        *event = POLLOUT;
+        arg += 5;
+    }
+    else
+    if(!strncmp(arg, "DRAINED<=", 9))
+    {
+        destination = &condition->drained_bytes;
+        *event = EVENT_DRAINED;
+        arg += 9;
+    }
+    else
+    {
+        return 0;
+    }
+    if(!parse_nonnegative_int(arg, &bytes))
+    {
+        return -1;
+    }
+    *destination = bytes;
+    return 1;
+}
+
+
+static
+struct condition * find_condition(struct sources const * sources, int fd)
+{
+    struct condition * condition = sources->conditions;
+    struct condition * const end = condition + sources->condition_count;
+    for(; condition < end; condition += 1)
+    {
+        if(condition->fd == fd)
+        {
+            return condition;
+        }
+    }
+    return 0;
+}
+
+
+/*\
+Gives the descriptors of a group the conditions parsed for it. Sockets that
+we opened ourselves also get the IN>= bytes as their receive low-water mark,
+so that the kernel does not even wake us until there is enough. Descriptors
+from the arguments are not touched that way, because the mark would stay
+with the socket and change how its other users' reads block.
+\*/
+static
+void apply_condition_group(struct condition const * group, short flags,
+                           struct pollfd * polls, nfds_t start,
+                           nfds_t end, struct sources * sources)
+{
+    if(!group->in_bytes && !group->out_bytes
+    && !(flags & (EVENT_DRAINED | EVENT_IDLE)))
+    {
+        return;
+    }
+    for(; start < end; start += 1)
+    {
+        int fd = polls[start].fd;
+        struct condition * condition = find_condition(sources, fd);
+        if(!condition)
+        {
+            condition = sources->conditions + sources->condition_count;
+            sources->condition_count += 1;
+            condition->fd = fd;
+            condition->drained_bytes = -1;
+            condition->delay = MIN_RECHECK_DELAY;
+        }
+        /*\
+        Draining frees up room, so OUT is a good hint of when to check how
+        much is left, but it is only reported if it was asked for too.
+        \*/
+        if(flags & EVENT_DRAINED)
+        {
+            condition->drained_bytes = group->drained_bytes;
+            if(!(flags & POLLOUT))
+            {
+                condition->hints |= POLLOUT;
+            }
+            polls[start].events |= POLLOUT;
+        }
+        /* IN is how activity shows, even if it is not asked for. */
+        if(flags & EVENT_IDLE)
+        {
+            condition->idle = group->idle;
+            condition->discard = group->discard;
+            if(!(flags & POLLIN))
+            {
+                condition->hints |= POLLIN;
+            }
+            polls[start].events |= POLLIN;
+        }
+        if(group->in_bytes)
+        {
+            condition->in_bytes = group->in_bytes;
+            if(find_source(sources, fd))
+            {
+                setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &group->in_bytes,
+                           sizeof(group->in_bytes));
+            }
+        }
+        if(group->out_bytes)
+        {
+            condition->out_bytes = group->out_bytes;
+        }
+    }
+}
+#endif
+
+
+/*\
+Parses the file descriptor, source, and event arguments into polls,
+counting them in nfds, and opening the sources. Returns zero, or the exit
+code of an error.
+\*/
+static
+int parse_polls(char * * argv, struct pollfd * polls, nfds_t * nfds,
+                struct sources * sources, char * arg0)
+{
+    char * arg = *argv;
+
+    polls[0].fd = 0;
+ 
+    short flags = 0;
+    nfds_t fdGroup_i = *nfds;
+    uint32_t file_flags = 0;
+    unsigned int sourceGroup_i = sources->count;
+    struct source * failed;
+#ifdef LINUX_EXTENSIONS
+    struct condition condition;
+    nfds_t conditionGroup_i = *nfds;
+    memset(&condition, 0, sizeof(condition));
+#endif
+ 
+    do
+    {
+        int fd;
+        struct source_type const * type = find_source_type(arg);
+        if(type || parse_nonnegative_int(arg, &fd))
+        {
+            /* If there were flags since the last FD, we need to apply them: */
+            if(flags || file_flags)
+            {
+                applyFlagsToFDGroup(flags, nfds, &fdGroup_i, polls);
+#ifdef LINUX_EXTENSIONS
+                apply_condition_group(&condition, flags, polls,
+                                      conditionGroup_i, *nfds, sources);
+                memset(&condition, 0, sizeof(condition));
+                conditionGroup_i = *nfds;
+#endif
+                failed = watch_path_group(file_flags, &sourceGroup_i, sources);
+                if(failed)
+                {
+                    return error_watching(failed, arg0);
+                }
+                /* Reset flags for next group. */
+                flags = 0;
+                file_flags = 0;
+            }
+            if(type)
+            {
+                fd = open_source(type, arg, sources);
+                if(fd == -2)
+                {
+                    return error_bad_file_descriptor_or_event(arg, arg0);
+                }
+                if(fd < 0)
+                {
+                    return error_opening(arg, arg0);
+                }
+            }
+            polls[*nfds].fd = fd;
+            *nfds += 1;
+            continue;
+        }
+  
+#ifdef LINUX_EXTENSIONS
+        /* Conditions come first, so that their pseudo-events need values. */
+        short event;
+        int parsed = parse_condition(arg, &condition, &event);
+        if(parsed > 0)
+        {
+            /* A condition also asks for the event it is on. */
+            flags |= event;
+            continue;
+        }
+        if(parsed < 0)
+        {
+            return error_bad_file_descriptor_or_event(arg, arg0);
+        }
+#endif
+
+        short flag = parse_event(arg);
+        if(flag)
+        {
+            flags |= flag;
+            continue;
+        }
+
+        struct source_event const * source_event = parse_source_event(arg);
+        if(source_event)
+        {
+            if(!is_source_event_group(source_event, polls, fdGroup_i, *nfds,
+                                      sources))
+            {
+                return error_bad_file_descriptor_or_event(arg, arg0);
+            }
+            flags |= source_event->flag;
+            continue;
+        }
+
+        uint32_t file_flag = parse_file_event(arg);
+        if(file_flag)
+        {
+            file_flags |= file_flag;
+            continue;
+        }
+  
+        return error_bad_file_descriptor_or_event(arg, arg0);
+    }
+    while((arg = *++argv));
+    /* Need to apply flags to last FD group: */
+    applyFlagsToFDGroup(flags, nfds, &fdGroup_i, polls);
+#ifdef LINUX_EXTENSIONS
+    apply_condition_group(&condition, flags, polls, conditionGroup_i, *nfds,
+                          sources);
+#endif
+    failed = watch_path_group(file_flags, &sourceGroup_i, sources);
+    if(failed)
+    {
+        return error_watching(failed, arg0);
+    }
+    for(fdGroup_i = 0; fdGroup_i < *nfds; fdGroup_i += 1)
+    {
+        struct source * source = find_source(sources, polls[fdGroup_i].fd);
+        if(source)
+        {
+            source->asked = polls[fdGroup_i].events;
+            polls[fdGroup_i].events |= source->events;
+        }
+    }
+    return 0;
+}
+
+
+/*\
+An expression is compiled to postfix: atoms push whether their event was
+seen on their descriptor, and operators pop their operands and push their
+result, so evaluating it is one pass with a small stack.
+\*/
+struct term
+{
+    /* '&', '|', '!', or 0 for an atom */
+    char operator;
+    int fd;
+    short event;
+};
+
+
+struct expression
+{
+    struct term * terms;
+    unsigned int count;
+    unsigned int atoms;
+};
+
+
+static
+char const * skip_spaces(char const * text)
+{
+    while(*text == ' ' || *text == '\t' || *text == '\n')
+    {
+        text += 1;
+    }
+    return text;
+}
+
+
+static
+struct term * add_term(struct expression * expression, char operator)
+{
+    struct term * term = expression->terms + expression->count;
+    expression->count += 1;
+    term->operator = operator;
+    return term;
+}
+
+
+/* <fd>:<event> */
+static
+int parse_atom(char const * * text, struct expression * expression)
+{
+    char digits[sizeof(STRINGIFY(INT_MAX))];
+    char name[16];
+    char const * start = *text;
+    size_t length = 0;
+    struct term * term;
+    int fd;
+    short event;
+    while(start[length] >= '0' && start[length] <= '9')
+    {
+        length += 1;
+    }
+    if(!length || length >= sizeof(digits) || start[length] != ':')
+    {
+        return -1;
+    }
+    memcpy(digits, start, length);
+    digits[length] = '\0';
+    if(!parse_nonnegative_int(digits, &fd))
+    {
+        return -1;
+    }
+    start += length + 1;
+    length = 0;
+    while((start[length] >= 'A' && start[length] <= 'Z')
+       || start[length] == '_')
+    {
+        length += 1;
+    }
+    if(!length || length >= sizeof(name))
+    {
+        return -1;
+    }
+    memcpy(name, start, length);
+    name[length] = '\0';
+    event = parse_event(name);
+    if(!event)
+    {
+        return -1;
+    }
+    term = add_term(expression, 0);
+    term->fd = fd;
+    term->event = event;
+    expression->atoms += 1;
+    *text = start + length;
+    return 0;
+}
+
+
+static
+int parse_or(char const * * text, struct expression * expression);
+
+
+static
+int parse_not(char const * * text, struct expression * expression)
+{
+    *text = skip_spaces(*text);
+    if(**text == '!')
+    {
+        *text += 1;
+        if(parse_not(text, expression) < 0)
+        {
+            return -1;
+        }
+        add_term(expression, '!');
+        return 0;
+    }
+    if(**text == '(')
+    {
+        *text += 1;
+        if(parse_or(text, expression) < 0)
+        {
+            return -1;
+        }
+        *text = skip_spaces(*text);
+        if(**text != ')')
+        {
+            return -1;
+        }
+        *text += 1;
+        return 0;
+    }
+    return parse_atom(text, expression);
+}
+
+
+static
+int parse_and(char const * * text, struct expression * expression)
+{
+    if(parse_not(text, expression) < 0)
+    {
+        return -1;
+    }
+    for(;;)
+    {
+        *text = skip_spaces(*text);
+        if(**text != '&')
+        {
+            return 0;
+        }
+        *text += 1;
+        if(parse_not(text, expression) < 0)
+        {
+            return -1;
+        }
+        add_term(expression, '&');
+    }
+}
+
+
+static
+int parse_or(char const * * text, struct expression * expression)
+{
+    if(parse_and(text, expression) < 0)
+    {
+        return -1;
+    }
+    for(;;)
+    {
+        *text = skip_spaces(*text);
+        if(**text != '|')
+        {
+            return 0;
+        }
+        *text += 1;
+        if(parse_and(text, expression) < 0)
+        {
+            return -1;
+        }
+        add_term(expression, '|');
+    }
+}
+
+
+/*\
+Compiles an expression like `(3:IN & 4:OUT) | !5:HUP`. Returns zero, -1 if
+the expression is bad, or -2 if memory could not be allocated.
+\*/
+static
+int compile_expression(char const * text, struct expression * expression)
+{
+    /* Every term takes up at least one character. */
+    expression->terms = calloc(strlen(text) + 1, sizeof(struct term));
+    if(!expression->terms)
+    {
+        return -2;
+    }
+    expression->count = 0;
+    expression->atoms = 0;
+    if(parse_or(&text, expression) < 0 || *skip_spaces(text))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Adds a poll for every atom of the expression. */
+static
+void add_expression_polls(struct expression const * expression,
+                          struct pollfd * polls, nfds_t * nfds)
+{
+    struct term const * term = expression->terms;
+    struct term const * const end = term + expression->count;
+    for(; term < end; term += 1)
+    {
+        if(!term->operator)
+        {
+            polls[*nfds].fd = term->fd;
+            polls[*nfds].events = term->event;
+            *nfds += 1;
+        }
+    }
+}
+
+
+static
+int evaluate_expression(struct expression const * expression,
+                        int const * fds, short const * seen, nfds_t nfds,
+                        int * stack)
+{
+    struct term const * term = expression->terms;
+    struct term const * const end = term + expression->count;
+    int * top = stack;
+    for(; term < end; term += 1)
+    {
+        nfds_t index;
+        switch(term->operator)
+        {
+        case '!':
+            top[-1] = !top[-1];
+            break;
+        case '&':
+            top -= 1;
+            top[-1] = top[-1] && top[0];
+            break;
+        case '|':
+            top -= 1;
+            top[-1] = top[-1] || top[0];
+            break;
+        default:
+            *top = 0;
+            for(index = 0; index < nfds; index += 1)
+            {
+                if(fds[index] == term->fd)
+                {
+                    *top = !!(seen[index] & term->event);
+                    break;
+                }
+            }
+            top += 1;
+        }
+    }
+    return stack[0];
+}
+
+
+static
+int pollfdcmp(void const * poll1, void const * poll2)
+{
+    return ((struct pollfd * )poll1)->fd - ((struct pollfd * )poll2)->fd;
+}
+
+
+static
+nfds_t merge_sorted_polls(struct pollfd * polls, nfds_t count)
+{
+    struct pollfd const * const end = polls + count;
+    struct pollfd * last_unique = polls;
+    struct pollfd const * next = polls + 1;
+    for(; next < end; next += 1)
+    {
+        if(last_unique->fd == next->fd)
+        {
+            last_unique->events |= next->events;
+            count -= 1;
+        }
+        else
+        {
+            last_unique += 1;
+            *last_unique = *next;
+        }
+    }
+    return count;
+}
+
+
+/* Only descriptors up to this many times the number of polls are dense. */
+#define DENSE_FACTOR 4
+#define BITMAP_WORD_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+
+static
+unsigned int lowest_bit(unsigned long word)
+{
+#ifdef __GNUC__
+    return __builtin_ctzl(word);
+#else
+    unsigned int bit = 0;
+    while(!(word & 1))
+    {
+        word >>= 1;
+        bit += 1;
+    }
+    return bit;
+#endif
+}
+
+
+/*\
+Descriptors are usually numbered densely from 0 up, so instead of sorting
+the polls, each descriptor can be marked in a bitmap and have its events put
+together in a table indexed by it, and then the bitmap read back in order,
+a whole word of it at a time. Returns how many polls are left, or 0 if the
+descriptors are too sparse for this or memory could not be allocated (so
+that sorting has to do).
+\*/
+static
+nfds_t merge_dense_polls(struct pollfd * polls, nfds_t count)
+{
+    unsigned long * bitmap;
+    short * events;
+    size_t words;
+    size_t word;
+    nfds_t index;
+    int highest = 0;
+    for(index = 0; index < count; index += 1)
+    {
+        if(polls[index].fd > highest)
+        {
+            highest = polls[index].fd;
+        }
+    }
+    if((nfds_t)highest >= count * DENSE_FACTOR)
+    {
+        return 0;
+    }
+    words = highest / BITMAP_WORD_BITS + 1;
+    bitmap = calloc(words, sizeof(unsigned long));
+    events = calloc(highest + 1, sizeof(short));
+    if(!bitmap || !events)
+    {
+        free(bitmap);
+        free(events);
+        return 0;
+    }
+    for(index = 0; index < count; index += 1)
+    {
+        int fd = polls[index].fd;
+        bitmap[fd / BITMAP_WORD_BITS] |= 1UL << fd % BITMAP_WORD_BITS;
+        events[fd] |= polls[index].events;
+    }
+    index = 0;
+    for(word = 0; word < words; word += 1)
+    {
+        unsigned long bits = bitmap[word];
+        while(bits)
+        {
+            int fd = word * BITMAP_WORD_BITS + lowest_bit(bits);
+            polls[index].fd = fd;
+            polls[index].events = events[fd];
+            polls[index].revents = 0;
+            index += 1;
+            bits &= bits - 1;
+        }
+    }
+    free(bitmap);
+    free(events);
+    return index;
+}
+
+
+/* Sorts the polls by descriptor, merging the ones for the same descriptor. */
+static
+nfds_t sort_and_merge_polls(struct pollfd * polls, nfds_t count)
+{
+    nfds_t merged;
+    if(!count)
+    {
+        return 0;
+    }
+    merged = merge_dense_polls(polls, count);
+    if(merged)
+    {
+        return merged;
+    }
+    qsort(polls, count, sizeof(struct pollfd), pollfdcmp);
+    return merge_sorted_polls(polls, count);
+}
+
+
+/*\
+Returns the index of the first poll from the given one on that has events,
+or nfds if none do. After a wake on a big set of descriptors, most of them
+usually have none, so with SSE2, the events of 16 polls are checked at once.
+\*/
+static
+nfds_t next_ready_poll(struct pollfd const * polls, nfds_t index,
+                       nfds_t nfds)
+{
+#ifdef __SSE2__
+    /* revents is the last 16 bits of each 8 byte pollfd on Linux. */
+    if(sizeof(struct pollfd) == 8 && offsetof(struct pollfd, revents) == 6)
+    {
+        __m128i const mask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+        __m128i const zero = _mm_setzero_si128();
+        for(; index + 16 <= nfds; index += 16)
+        {
+            __m128i const * block = (__m128i const *)(polls + index);
+            __m128i any = zero;
+            int load;
+            for(load = 0; load < 8; load += 1)
+            {
+                any = _mm_or_si128(any, _mm_loadu_si128(block + load));
+            }
+            any = _mm_and_si128(any, mask);
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xFFFF)
+            {
+                break;
+            }
+        }
+    }
+#endif
+    while(index < nfds && !polls[index].revents)
+    {
+        index += 1;
+    }
+    return index;
+}
+
+
+static
+long long monotonic_nanoseconds(void)
+{
+    struct timespec now;
+    /* CLOCK_MONOTONIC is always supported where clock_gettime is. */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+static
+long long deadline_after(int timeout)
+{
+    if(timeout < 0)
+    {
+        return -1;
+    }
+    return monotonic_nanoseconds() + (long long)timeout * 1000000;
+}
+
+
+#ifdef LINUX_EXTENSIONS
+/*\
+ppoll takes the timeout in nanoseconds, so deadlines that are less than a
+millisecond away (like the end of a --gather window) are not rounded up.
+\*/
+static
+int poll_for_remaining(struct pollfd * polls, nfds_t nfds,
+                       long long deadline)
+{
+    struct timespec timeout;
+    long long remaining;
+    if(deadline < 0)
+    {
+        return ppoll(polls, nfds, 0, 0);
+    }
+    remaining = deadline - monotonic_nanoseconds();
+    if(remaining < 0)
+    {
+        remaining = 0;
+    }
+    timeout.tv_sec = remaining / 1000000000;
+    timeout.tv_nsec = remaining % 1000000000;
+    return ppoll(polls, nfds, &timeout, 0);
+}
+#else
+static
+int remaining_timeout(long long deadline)
+{
+    long long remaining;
+    if(deadline < 0)
+    {
+        return -1;
+    }
+    remaining = deadline - monotonic_nanoseconds();
+    if(remaining <= 0)
+    {
+        return 0;
+    }
+    /* Round up, so that we never wake up just before the deadline. */
+    return (remaining + 999999) / 1000000;
+}
+
+
+static
+int poll_for_remaining(struct pollfd * polls, nfds_t nfds,
+                       long long deadline)
+{
+    return poll(polls, nfds, remaining_timeout(deadline));
+}
+#endif
+
+
+/*\
+Polls until there are events or the deadline has passed. Signals are meant
+to be polled for with signal sources, so an interrupted wait is not an
+error: it just carries on waiting for what is left of the timeout.
+\*/
+static
+int poll_until(struct pollfd * polls, nfds_t nfds, long long deadline)
+{
+    for(;;)
+    {
+        int result = poll_for_remaining(polls, nfds, deadline);
+        if(result >= 0 || errno != EINTR)
+        {
+            return result;
+        }
+    }
+}
+
+
+#ifdef LINUX_EXTENSIONS
+static
+int readable_bytes(int fd)
+{
+    int bytes;
+    if(ioctl(fd, FIONREAD, &bytes) < 0)
+    {
+        return -1;
+    }
+    return bytes;
+}
+
+
+/*\
+Returns how much is queued for the reader at the other end of a pipe or
+socket, or -1 if we can't know it.
+\*/
+static
+int queued_bytes(int fd)
+{
+    struct stat status;
+    int queued;
+    if(fstat(fd, &status) < 0)
+    {
+        return -1;
+    }
+    if(S_ISFIFO(status.st_mode))
+    {
+        /* Either end of a pipe tells how much is in it. */
+        if(ioctl(fd, FIONREAD, &queued) < 0)
+        {
+            return -1;
+        }
+        return queued;
+    }
+    if(S_ISSOCK(status.st_mode))
+    {
+        /* For TCP, this counts what is not acknowledged yet too. */
+        if(ioctl(fd, SIOCOUTQ, &queued) < 0)
+        {
+            return -1;
+        }
+        return queued;
+    }
+    return -1;
+}
+
+
+/* Returns the room left for writing, or -1 if we can't know it. */
+static
+int writable_space(int fd)
+{
+    struct stat status;
+    int size;
+    int queued;
+    socklen_t length = sizeof(size);
+    if(fstat(fd, &status) < 0)
+    {
+        return -1;
+    }
+    if(S_ISFIFO(status.st_mode))
+    {
+        size = fcntl(fd, F_GETPIPE_SZ);
+        if(size < 0 || ioctl(fd, FIONREAD, &queued) < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    if(S_ISSOCK(status.st_mode))
+    {
+        if(getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, &length) < 0
+        || ioctl(fd, SIOCOUTQ, &queued) < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        return -1;
+    }
+    return queued < size ? size - queued : 0;
+}
+
+
+/* Reads and throws away what can be read right now. Returns how much. */
+static
+int discard_readable(int fd)
+{
+    char buffer[4096];
+    int total = 0;
+    int reads;
+    /*\
+    Only what is already there is read, so that this never blocks, and it is
+    limited, so that a writer that keeps up with us can't keep us here.
+    \*/
+    for(reads = 0; reads < 64; reads += 1)
+    {
+        ssize_t count;
+        int bytes = readable_bytes(fd);
+        if(bytes <= 0)
+        {
+            break;
+        }
+        if((size_t)bytes > sizeof(buffer))
+        {
+            bytes = sizeof(buffer);
+        }
+        count = read(fd, buffer, bytes);
+        if(count <= 0)
+        {
+            if(count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        total += count;
+    }
+    return total;
+}
+
+
+/*\
+Notes activity on an IDLE descriptor with IN: new data, or any change in how
+much is readable (a reader is activity too). Without reading, IN stays on
+as long as there is data, so it is held for a while like an event that is
+not enough, and then sampled again. Returns the events to hold.
+\*/
+static
+short check_activity(struct condition * condition, long long now)
+{
+    int readable;
+    if(condition->discard)
+    {
+        if(discard_readable(condition->fd) > 0)
+        {
+            condition->active = now;
+            return 0;
+        }
+        /* Nothing to read but IN means end of file, which stays on. */
+        return POLLIN & condition->hints;
+    }
+    readable = readable_bytes(condition->fd);
+    if(readable != condition->readable)
+    {
+        condition->active = now;
+        condition->readable = readable;
+    }
+    return POLLIN & condition->hints;
+}
+
+
+/*\
+Adds IDLE to the results of descriptors which were quiet for long enough,
+and starts their next quiet period, so that watching them reports IDLE
+once per period instead of on every wait. Returns how many polls got
+events which had none.
+\*/
+static
+int check_idle(struct pollfd * polls, nfds_t nfds,
+               struct sources const * sources, long long now)
+{
+    int count = 0;
+    struct condition * condition = sources->conditions;
+    struct condition * const end = condition + sources->condition_count;
+    for(; condition < end; condition += 1)
+    {
+        nfds_t index;
+        if(!condition->idle
+        || now < condition->active + (long long)condition->idle * 1000000)
+        {
+            continue;
+        }
+        condition->active = now;
+        for(index = 0; index < nfds; index += 1)
+        {
+            if(polls[index].fd == condition->fd)
+            {
+                count += !polls[index].revents;
+                polls[index].revents |= EVENT_IDLE;
+            }
+        }
+    }
+    return count;
+}
+
+
+/*\
+Takes the events which are not enough for their condition yet out of the
+results, and holds them out of the poll until it is time to check again.
+An event that comes with HUP or ERR is let through as it is, because no
+more is coming. Pseudo-events are added to the results when their time has
+come, and hints are taken out. Returns how many polls still have events.
+\*/
+static
+int check_conditions(struct pollfd * polls, nfds_t nfds,
+                     struct sources const * sources)
+{
+    long long now = monotonic_nanoseconds();
+    int count = 0;
+    nfds_t index;
+    for(index = 0; index < nfds; index += 1)
+    {
+        struct pollfd * poll = polls + index;
+        struct condition * condition;
+        short unmet = 0;
+        int bytes;
+        if(!poll->revents)
+        {
+            continue;
+        }
+        condition = find_condition(sources, poll->fd);
+        if(condition && !(poll->revents & (POLLERR | POLLHUP)))
+        {
+            if(poll->revents & POLLIN && condition->in_bytes
+            && (bytes = readable_bytes(poll->fd)) >= 0
+            && bytes < condition->in_bytes)
+            {
+                unmet |= POLLIN;
+            }
+            if(poll->revents & POLLOUT && condition->out_bytes
+            && (bytes = writable_space(poll->fd)) >= 0
+            && bytes < condition->out_bytes)
+            {
+                unmet |= POLLOUT;
+            }
+            if(poll->revents & POLLOUT && condition->drained_bytes >= 0)
+            {
+                bytes = queued_bytes(poll->fd);
+                if(bytes >= 0 && bytes <= condition->drained_bytes)
+                {
+                    poll->revents |= EVENT_DRAINED;
+                }
+                else
+                {
+                    unmet |= POLLOUT & condition->hints;
+                }
+            }
+            if(poll->revents & POLLIN && condition->idle)
+            {
+                unmet |= check_activity(condition, now);
+            }
+            if(unmet)
+            {
+                poll->revents &= ~unmet;
+                poll->events &= ~unmet;
+                condition->held |= unmet;
+                condition->recheck = now
+                                   + (long long)condition->delay * 1000000;
+                condition->delay *= 2;
+                if(condition->delay > MAX_RECHECK_DELAY)
+                {
+                    condition->delay = MAX_RECHECK_DELAY;
+                }
+            }
+            else
+            {
+                condition->delay = MIN_RECHECK_DELAY;
+            }
+        }
+        if(condition)
+        {
+            poll->revents &= ~condition->hints;
+        }
+        if(poll->revents)
+        {
+            count += 1;
+        }
+    }
+    return count + check_idle(polls, nfds, sources, now);
+}
+
+
+/*\
+Puts the held events whose recheck time has come back into the poll, and
+starts the quiet periods of IDLE descriptors on the first wait. Returns the
+earliest time that a condition needs to be checked again, or -1.
+\*/
+static
+long long release_held_events(struct pollfd * polls, nfds_t nfds,
+                              struct sources const * sources)
+{
+    long long now = monotonic_nanoseconds();
+    long long earliest = -1;
+    struct condition * condition = sources->conditions;
+    struct condition * const end = condition + sources->condition_count;
+    for(; condition < end; condition += 1)
+    {
+        if(condition->idle)
+        {
+            long long quiet;
+            if(!condition->active)
+            {
+                condition->active = now;
+                condition->readable = readable_bytes(condition->fd);
+            }
+            quiet = condition->active + (long long)condition->idle * 1000000;
+            if(earliest < 0 || quiet < earliest)
+            {
+                earliest = quiet;
+            }
+        }
+        if(!condition->held)
+        {
+            continue;
+        }
+        if(condition->recheck <= now)
+        {
+            nfds_t index;
+            for(index = 0; index < nfds; index += 1)
+            {
+                if(polls[index].fd == condition->fd)
+                {
+                    polls[index].events |= condition->held;
+                }
+            }
+            condition->held = 0;
+        }
+        else
+        if(earliest < 0 || condition->recheck < earliest)
+        {
+            earliest = condition->recheck;
+        }
+    }
+    return earliest;
+}
+#endif
+
+
+/*\
+Polls until there are events that meet their conditions, or the deadline
+has passed. Returns how many polls have events, like `poll`.
+\*/
+static
+int wait_for_events(struct pollfd * polls, nfds_t nfds, long long deadline,
+                    struct sources const * sources)
+{
+#ifdef LINUX_EXTENSIONS
+    while(sources->condition_count)
+    {
+        long long wake = release_held_events(polls, nfds, sources);
+        int result;
+        if(wake < 0 || (deadline >= 0 && deadline < wake))
+        {
+            wake = deadline;
+        }
+        result = poll_until(polls, nfds, wake);
+        if(result < 0)
+        {
+            return result;
+        }
+        /* Even without events, it can be time for a pseudo-event. */
+        result = check_conditions(polls, nfds, sources);
+        if(result)
+        {
+            return result;
+        }
+        if(deadline >= 0 && monotonic_nanoseconds() >= deadline)
+        {
+            return 0;
+        }
+    }
+#else
+    (void)sources;
+#endif
+    return poll_until(polls, nfds, deadline);
+}
+
+
+static
+int update_exitcode(int exitcode, struct pollfd const * poll)
+{
+    if(poll->revents & poll->events)
+    {
+        return EXIT_ASKED_EVENT_OR_INFO;
+    }
+    if(poll->revents && exitcode == EXIT_NO_EVENT)
+    {
+        return EXIT_UNASKED_EVENT;
+    }
+    return exitcode;
+}
+
+
+/*\
+Output written from inside loops is only checked for errors here, once per
+wake-up: the stream error indicator remembers any failed write until then.
+\*/
+static
+int flush_output(FILE * stream)
+{
+    if(fflush(stream) == EOF || ferror(stream))
+    {
+        return EOF;
+    }
+    return 0;
+}
+
+
+struct child
+{
+    char * command;
+    pid_t pid;
+};
+
+
+/* The connection that won a race, for handing to the children. */
+struct race
+{
+    /* The descriptor the children get it as, -1 if there is no race. */
+    int fd;
+    /* Our descriptor of it, -1 if nothing won. */
+    int winner;
+};
+
+
+struct child_output
+{
+    int fd;
+    unsigned int number;
+    char const * name;
+    size_t length;
+    char buffer[MAX_LINE];
+};
+
+
+static
+int make_child_pipe(int ends[2], int minimum)
+{
+    if(pipe(ends) < 0
+    || (ends[0] = move_descriptor(ends[0], minimum)) < 0
+    || (ends[1] = move_descriptor(ends[1], minimum)) < 0
+    || set_descriptor_flag(ends[0], F_GETFL, F_SETFL, O_NONBLOCK) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*\
+Starts the child with its stdout and stderr going into new pipes, whose
+reading ends are returned in the two child outputs. All our pipe ends are
+close-on-exec, so children only ever inherit their own writing ends, and
+the winning connection of a race if there is one.
+\*/
+static
+int spawn_child(struct child * child, unsigned int number,
+                struct sources const * sources, struct race const * race,
+                struct child_output * outputs)
+{
+    extern char * * environ;
+    char * argv[4];
+    int out[2];
+    int err[2];
+    int error;
+    int have_actions = 0;
+    int have_attributes = 0;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    argv[0] = "sh";
+    argv[1] = "-c";
+    argv[2] = child->command;
+    argv[3] = 0;
+    if(make_child_pipe(out, sources->minimum) < 0
+    || make_child_pipe(err, sources->minimum) < 0)
+    {
+        return -1;
+    }
+    error = posix_spawn_file_actions_init(&actions);
+    if(!error)
+    {
+        have_actions = 1;
+        error = posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+    }
+    if(!error)
+    {
+        error = posix_spawn_file_actions_adddup2(&actions, err[1], 2);
+    }
+    if(!error && race->winner >= 0)
+    {
+        error = posix_spawn_file_actions_adddup2(&actions, race->winner,
+                                                 race->fd);
+    }
+    /* Children should not inherit the signals blocked for signal sources. */
+    if(!error)
+    {
+        error = posix_spawnattr_init(&attributes);
+    }
+    if(!error)
+    {
+        have_attributes = 1;
+        error = posix_spawnattr_setsigmask(&attributes, &sources->mask);
+    }
+    /* In a process group of its own, it can be stopped with what it ran. */
+    if(!error)
+    {
+        error = posix_spawnattr_setpgroup(&attributes, 0);
+    }
+    if(!error)
+    {
+        error = posix_spawnattr_setflags(&attributes,
+                                         POSIX_SPAWN_SETSIGMASK
+                                         | POSIX_SPAWN_SETPGROUP);
+    }
+    if(!error)
+    {
+        error = posix_spawn(&child->pid, "/bin/sh", &actions, &attributes,
+                            argv, environ);
+    }
+    if(have_actions)
+    {
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    if(have_attributes)
+    {
+        posix_spawnattr_destroy(&attributes);
+    }
+    if(error)
+    {
+        errno = error;
+        return -1;
+    }
+    close(out[1]);
+    close(err[1]);
+    outputs[0].fd = out[0];
+    outputs[0].number = number;
+    outputs[0].name = "out";
+    outputs[1].fd = err[0];
+    outputs[1].number = number;
+    outputs[1].name = "err";
+    return 0;
+}
+
+
+static
+int fput_child_label(unsigned int number, FILE * stream)
+{
+    if(fputs("spawn:", stream) == EOF)
+    {
+        return EOF;
+    }
+    return fput_nonnegative_int(number, stream);
+}
+
+
+static
+int fput_child_line(struct child_output const * output, char const * line,
+                    size_t length, FILE * stream)
+{
+    if(fput_child_label(output->number, stream) == EOF
+    || fputc(' ', stream) == EOF
+    || fputs(output->name, stream) == EOF
+    || fputc(' ', stream) == EOF
+    || fwrite(line, 1, length, stream) < length)
+    {
+        return EOF;
+    }
+    return fputc('\n', stream);
+}
+
+
+/*\
+Writes out every complete line in the buffer, and keeps an incomplete line
+for later, unless it fills the whole buffer or the output has ended - then
+it is written out as if it was complete.
+\*/
+static
+int fput_child_lines(struct child_output * output, int ended, FILE * stream)
+{
+    char * start = output->buffer;
+    char * const stop = output->buffer + output->length;
+    while(start < stop)
+    {
+        char * newline = memchr(start, '\n', stop - start);
+        size_t length = newline ? (size_t)(newline - start)
+                                : (size_t)(stop - start);
+        if(!newline && !ended && output->length < MAX_LINE)
+        {
+            break;
+        }
+        if(fput_child_line(output, start, length, stream) == EOF)
+        {
+            return EOF;
+        }
+        start += length + !!newline;
+        if(!newline)
+        {
+            break;
+        }
+    }
+    output->length = stop - start;
+    memmove(output->buffer, start, output->length);
+    return 0;
+}
+
+
+/*\
+Reads everything the child output pipe has for us right now. Returns 1 if
+the pipe is still open, 0 if the output has ended, and -1 with `errno` set
+on read errors. Write errors are left to be caught by `flush_output`.
+\*/
+static
+int read_child_output(struct child_output * output, FILE * stream)
+{
+    for(;;)
+    {
+        ssize_t count = read(output->fd, output->buffer + output->length,
+                             MAX_LINE - output->length);
+        if(count < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 1;
+            }
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        output->length += count;
+        fput_child_lines(output, !count, stream);
+        if(!count)
+        {
+            return 0;
+        }
+    }
+}
+
+
+static
+struct child_output * find_child_output(struct child_output * outputs,
+                                        unsigned int count, int fd)
+{
+    struct child_output * const end = outputs + count;
+    for(; outputs < end; outputs += 1)
+    {
+        if(outputs->fd == fd)
+        {
+            return outputs;
+        }
+    }
+    return 0;
+}
+
+
+static
+int child_exit_status(int status)
+{
+    if(WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+
+/*\
+Waits for all children, reporting each one's exit status. Their statuses
+would be mistaken for our own exit codes, so any failure is just one code.
+\*/
+static
+int wait_children(struct child const * children, unsigned int count,
+                  char * arg0)
+{
+    int exitcode = EXIT_ASKED_EVENT_OR_INFO;
+    unsigned int index;
+    for(index = 0; index < count; index += 1)
+    {
+        int status;
+        while(waitpid(children[index].pid, &status, 0) < 0)
+        {
+            if(errno != EINTR)
+            {
+                return error_waiting(arg0);
+            }
+        }
+        status = child_exit_status(status);
+        if(status)
+        {
+            exitcode = EXIT_SPAWNED_FAILED;
+        }
+        if(fput_child_label(index + 1, stdout) == EOF
+        || fputs(" EXIT ", stdout) == EOF
+        || fput_nonnegative_int(status, stdout) == EOF
+        || fputc('\n', stdout) == EOF)
+        {
+            return error_writing_output(arg0);
+        }
+    }
+    if(fflush(stdout) == EOF)
+    {
+        return error_writing_output(arg0);
+    }
+    return exitcode;
+}
+
+
+/*\
+Asks the children that are still running to stop, along with everything
+they started, when the timeout runs out. Children that already exited are
+zombies until we exit, so their process groups are still theirs to signal,
+and nothing is waited for.
+\*/
+static
+void stop_children(struct child const * children, unsigned int count)
+{
+    unsigned int index;
+    for(index = 0; index < count; index += 1)
+    {
+        kill(-children[index].pid, SIGTERM);
+    }
+}
+
+
+/*\
+Streams the output of the children until all of it has ended, and then
+waits for them. Events on the other descriptors are reported once, and
+then those descriptors are dropped from the poll set (negative descriptors
+are ignored by `poll`), so that they do not keep waking us up.
+\*/
+static
+int run_children(struct pollfd * polls, nfds_t nfds, int timeout,
+                 struct sources const * sources,
+                 struct child const * children, unsigned int child_count,
+                 struct child_output * outputs, char * arg0)
+{
+    long long deadline = deadline_after(timeout);
+    unsigned int open = child_count * 2;
+    while(open)
+    {
+        nfds_t index;
+        int result = wait_for_events(polls, nfds, deadline, sources);
+        if(result < 0)
+        {
+            return error_polling(arg0);
+        }
+        if(!result)
+        {
+            stop_children(children, child_count);
+            return EXIT_NO_EVENT;
+        }
+        for(index = 0; result; index += 1)
+        {
+            struct pollfd * poll = polls + index;
+            struct child_output * output;
+            int error;
+            if(!poll->revents)
+            {
+                continue;
+            }
+            result -= 1;
+            output = find_child_output(outputs, child_count * 2, poll->fd);
+            if(output)
+            {
+                int status = read_child_output(output, stdout);
+                if(status < 0)
+                {
+                    return error_reading(arg0);
+                }
+                if(!status)
+                {
+                    close(output->fd);
+                    output->fd = -1;
+                    poll->fd = -1;
+                    open -= 1;
+                }
+                continue;
+            }
+            error = report_poll(poll, sources, arg0);
+            if(error > 0)
+            {
+                return error;
+            }
+            if(!error)
+            {
+                poll->fd = -1;
+            }
+        }
+        if(flush_output(stdout) == EOF)
+        {
+            return error_writing_output(arg0);
+        }
+    }
+    return wait_children(children, child_count, arg0);
+}
+
+
+#ifdef LINUX_EXTENSIONS
+struct relay
+{
+    int enabled;
+    unsigned int batch;
+    int length_framing;
+    int with_address;
+};
+
+
+static
+int is_datagram_socket(int fd)
+{
+    int type;
+    socklen_t length = sizeof(type);
+    if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) < 0)
+    {
+        return 0;
+    }
+    return type == SOCK_DGRAM;
+}
+
+
+static
+int fput_address(struct sockaddr_storage const * address, socklen_t length,
+                 FILE * stream)
+{
+    char buffer[INET6_ADDRSTRLEN];
+    if(address->ss_family == AF_INET)
+    {
+        struct sockaddr_in const * inet = (void const * )address;
+        if(!inet_ntop(AF_INET, &inet->sin_addr, buffer, sizeof(buffer))
+        || fputs(buffer, stream) == EOF
+        || fputc(':', stream) == EOF)
+        {
+            return EOF;
+        }
+        return fput_nonnegative_int(ntohs(inet->sin_port), stream);
+    }
+    if(address->ss_family == AF_INET6)
+    {
+        struct sockaddr_in6 const * inet6 = (void const * )address;
+        if(!inet_ntop(AF_INET6, &inet6->sin6_addr, buffer, sizeof(buffer))
+        || fputc('[', stream) == EOF
+        || fputs(buffer, stream) == EOF
+        || fputs("]:", stream) == EOF)
+        {
+            return EOF;
+        }
+        return fput_nonnegative_int(ntohs(inet6->sin6_port), stream);
+    }
+    if(address->ss_family == AF_UNIX
+    && length > offsetof(struct sockaddr_un, sun_path))
+    {
+        struct sockaddr_un const * unix_ = (void const * )address;
+        char const * path = unix_->sun_path;
+        size_t path_length = length - offsetof(struct sockaddr_un, sun_path);
+        /* Abstract socket names start with a null byte instead of a path. */
+        if(!*path)
+        {
+            if(fputc('@', stream) == EOF)
+            {
+                return EOF;
+            }
+            path += 1;
+            path_length -= 1;
+        }
+        else
+        {
+            path_length = strnlen(path, path_length);
+        }
+        if(fwrite(path, 1, path_length, stream) < path_length)
+        {
+            return EOF;
+        }
+        return 0;
+    }
+    /* Unnamed sockets and unknown families have no printable address. */
+    return fputc('-', stream);
+}
+
+
+static
+int fput_datagram(struct mmsghdr const * message, struct relay const * relay,
+                  FILE * stream)
+{
+    struct msghdr const * header = &message->msg_hdr;
+    size_t length = message->msg_len;
+    /*\
+    Datagrams bigger than our buffer have been truncated by the kernel, and
+    we relay as much of them as we got.
+    \*/
+    if(length > header->msg_iov->iov_len)
+    {
+        length = header->msg_iov->iov_len;
+    }
+    if(relay->length_framing)
+    {
+        if(fput_nonnegative_int(length, stream) == EOF)
+        {
+            return EOF;
+        }
+        if(relay->with_address)
+        {
+            if(fputc(' ', stream) == EOF
+            || fput_address(header->msg_name, header->msg_namelen, stream)
+               == EOF)
+            {
+                return EOF;
+            }
+        }
+        if(fputc('\n', stream) == EOF)
+        {
+            return EOF;
+        }
+    }
+    else
+    if(relay->with_address)
+    {
+        if(fput_address(header->msg_name, header->msg_namelen, stream) == EOF
+        || fputc(' ', stream) == EOF)
+        {
+            return EOF;
+        }
+    }
+    if(fwrite(header->msg_iov->iov_base, 1, length, stream) < length)
+    {
+        return EOF;
+    }
+    if(!relay->length_framing)
+    {
+        return fputc('\n', stream);
+    }
+    return 0;
+}
+
+
+/*\
+Receives datagrams until the socket has none left, in batches of up to
+`relay->batch` datagrams per system call. Returns how many it relayed, or
+-1 with `errno` set. Write errors are left to be caught by `flush_output`.
+\*/
+static
+long drain_datagrams(int fd, struct mmsghdr * messages,
+                     struct relay const * relay, FILE * stream)
+{
+    long relayed = 0;
+    for(;;)
+    {
+        int count;
+        unsigned int index;
+        for(index = 0; index < relay->batch; index += 1)
+        {
+            messages[index].msg_hdr.msg_namelen
+                = sizeof(struct sockaddr_storage);
+        }
+        count = recvmmsg(fd, messages, relay->batch, MSG_DONTWAIT, 0);
+        if(count < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return relayed;
+            }
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        for(index = 0; index < (unsigned int)count; index += 1)
+        {
+            fput_datagram(messages + index, relay, stream);
+        }
+        relayed += count;
+        /* A short batch means the receive queue is now empty. */
+        if((unsigned int)count < relay->batch)
+        {
+            return relayed;
+        }
+    }
+}
+
+
+static
+struct mmsghdr * allocate_messages(unsigned int batch)
+{
+    struct mmsghdr * messages = calloc(batch, sizeof(struct mmsghdr));
+    struct iovec * vectors = calloc(batch, sizeof(struct iovec));
+    struct sockaddr_storage * addresses
+        = calloc(batch, sizeof(struct sockaddr_storage));
+    char * buffers = malloc((size_t)batch * MAX_DATAGRAM);
+    unsigned int index;
+    if(!messages || !vectors || !addresses || !buffers)
+    {
+        return 0;
+    }
+    for(index = 0; index < batch; index += 1)
+    {
+        vectors[index].iov_base = buffers + (size_t)index * MAX_DATAGRAM;
+        vectors[index].iov_len = MAX_DATAGRAM;
+        messages[index].msg_hdr.msg_iov = vectors + index;
+        messages[index].msg_hdr.msg_iovlen = 1;
+        messages[index].msg_hdr.msg_name = addresses + index;
+    }
+    return messages;
+}
+
+
+/*\
+Relays datagrams from the ready datagram sockets until some other event
+happens or the timeout runs out. Other events are reported as usual, and
+end the relaying, so that a descriptor can be used to stop it.
+\*/
+static
+int relay_datagrams(struct pollfd * polls, nfds_t nfds, int timeout,
+                    struct sources const * sources,
+                    struct relay const * relay, char * arg0)
+{
+    long long deadline = deadline_after(timeout);
+    int exitcode = EXIT_NO_EVENT;
+    struct mmsghdr * messages = allocate_messages(relay->batch);
+    char * datagram = calloc(nfds, 1);
+    nfds_t index;
+    if(!messages || !datagram)
+    {
+        return error_allocating_memory(arg0);
+    }
+    for(index = 0; index < nfds; index += 1)
+    {
+        datagram[index] = is_datagram_socket(polls[index].fd);
+    }
+    for(;;)
+    {
+        int stop = 0;
+        int result = wait_for_events(polls, nfds, deadline, sources);
+        if(result < 0)
+        {
+            return error_polling(arg0);
+        }
+        if(!result)
+        {
+            return exitcode;
+        }
+        for(index = 0; result; index += 1)
+        {
+            struct pollfd * poll = polls + index;
+            int error;
+            if(!poll->revents)
+            {
+                continue;
+            }
+            result -= 1;
+            if(datagram[index] && poll->revents == POLLIN)
+            {
+                if(drain_datagrams(poll->fd, messages, relay, stdout) < 0)
+                {
+                    return error_receiving(arg0);
+                }
+                exitcode = EXIT_ASKED_EVENT_OR_INFO;
+                continue;
+            }
+            error = report_poll(poll, sources, arg0);
+            if(error > 0)
+            {
+                return error;
+            }
+            if(!error)
+            {
+                exitcode = update_exitcode(exitcode, poll);
+                stop = 1;
+            }
+        }
+        if(flush_output(stdout) == EOF)
+        {
+            return error_writing_output(arg0);
+        }
+        if(stop)
+        {
+            return exitcode;
+        }
+    }
+}
+
+
+/*\
+Races the connect: sources against each other, until one of them connects
+or the timeout runs out. Every event is reported as usual, but only a
+connection ends the race - the rest are dropped from the poll set, so that
+a refused or failed connection just leaves the others running. The losers
+are closed right away, so that whatever they connected to is not kept
+waiting. Returns the exit code for the events reported.
+\*/
+static
+int race_connections(struct pollfd * polls, nfds_t nfds, int timeout,
+                     struct sources const * sources, struct race * race,
+                     char * arg0)
+{
+    long long deadline = deadline_after(timeout);
+    int exitcode = EXIT_NO_EVENT;
+    nfds_t left = nfds;
+    struct source const * source = sources->list;
+    struct source const * const end = source + sources->count;
+    while(left && race->winner < 0)
+    {
+        nfds_t index;
+        int result = wait_for_events(polls, nfds, deadline, sources);
+        if(result < 0)
+        {
+            return error_polling(arg0);
+        }
+        if(!result)
+        {
+            break;
+        }
+        for(index = 0; result && race->winner < 0; index += 1)
+        {
+            struct pollfd * poll = polls + index;
+            struct source const * racer;
+            int error;
+            if(!poll->revents)
+            {
+                continue;
+            }
+            result -= 1;
+            racer = find_source(sources, poll->fd);
+            error = report_poll(poll, sources, arg0);
+            if(error > 0)
+            {
+                return error;
+            }
+            if(error)
+            {
+                continue;
+            }
+            exitcode = update_exitcode(exitcode, poll);
+            if(racer && racer->type->consume == consume_connect_source
+            && poll->revents & POLLOUT
+            && !(poll->revents & (POLLERR | POLLHUP)))
+            {
+                race->winner = poll->fd;
+            }
+            else
+            {
+                poll->fd = -1;
+                left -= 1;
+            }
+        }
+    }
+    if(flush_output(stdout) == EOF)
+    {
+        return error_writing_output(arg0);
+    }
+    for(; source < end; source += 1)
+    {
+        if(source->type->consume == consume_connect_source
+        && source->fd != race->winner)
+        {
+            close(source->fd);
+        }
+    }
+    return exitcode;
+}
+#endif
+
+
+#ifdef LINUX_EXTENSIONS
+struct match
+{
+    char * pattern;
+    int regex;
+    int pass;
+};
+
+
+/*\
+What is kept from the data read so far: the end of it that could be the
+start of a literal match, or the line so far for regular expressions.
+\*/
+struct match_buffer
+{
+    size_t length;
+    char bytes[MAX_LINE + 1];
+};
+
+
+/*\
+Looks for the literal pattern in the new data, and across the end of the
+data before it. glibc's memmem is vectorized, and with only the overlap
+kept, each byte is only looked at once (plus the overlap).
+\*/
+static
+int match_literal(char const * pattern, size_t length,
+                  struct match_buffer * kept, char const * data,
+                  size_t count)
+{
+    char overlap[MAX_LINE * 2];
+    size_t keep = length - 1;
+    size_t head = count < keep ? count : keep;
+    size_t total;
+    memcpy(overlap, kept->bytes, kept->length);
+    memcpy(overlap + kept->length, data, head);
+    total = kept->length + head;
+    if(memmem(overlap, total, pattern, length)
+    || memmem(data, count, pattern, length))
+    {
+        return 1;
+    }
+    if(count >= keep)
+    {
+        memcpy(kept->bytes, data + count - keep, keep);
+        kept->length = keep;
+        return 0;
+    }
+    /* All of the new data is in the overlap, after what was kept. */
+    if(total > keep)
+    {
+        memcpy(kept->bytes, overlap + total - keep, keep);
+        total = keep;
+    }
+    else
+    {
+        memcpy(kept->bytes, overlap, total);
+    }
+    kept->length = total;
+    return 0;
+}
+
+
+/* Adds to the line so far, cutting it down to its last half if too long. */
+static
+void append_to_line(struct match_buffer * line, char const * data,
+                    size_t count)
+{
+    if(line->length + count > MAX_LINE)
+    {
+        size_t keep = MAX_LINE / 2;
+        if(count >= keep)
+        {
+            data += count - keep;
+            count = keep;
+            line->length = 0;
+        }
+        else
+        {
+            size_t drop = line->length + count - keep;
+            memmove(line->bytes, line->bytes + drop, line->length - drop);
+            line->length -= drop;
+        }
+    }
+    memcpy(line->bytes + line->length, data, count);
+    line->length += count;
+    line->bytes[line->length] = '\0';
+}
+
+
+/*\
+Matches the regular expression against each line finished by the new data,
+and against the line so far if it is not finished, so that prompts which
+don't end with a newline are matched too.
+\*/
+static
+int match_regex(regex_t const * regex, struct match_buffer * line,
+                char const * data, size_t count)
+{
+    while(count)
+    {
+        char const * newline = memchr(data, '\n', count);
+        size_t part = newline ? (size_t)(newline - data) : count;
+        append_to_line(line, data, part);
+        if(!regexec(regex, line->bytes, 0, 0, 0))
+        {
+            return 1;
+        }
+        if(!newline)
+        {
+            break;
+        }
+        line->length = 0;
+        data += part + 1;
+        count -= part + 1;
+    }
+    return 0;
+}
+
+
+/* Sources that carry data which can be read like from any descriptor. */
+static
+int is_stream(int fd, struct sources const * sources)
+{
+    struct source const * source = find_source(sources, fd);
+    return !source
+        || source->type->open == open_fifo_source
+        || source->type->open == open_unix_source
+        || source->type->open == open_connect_source;
+}
+
+
+static
+int fput_match(int fd, struct sources const * sources, FILE * stream)
+{
+    struct source const * source = find_source(sources, fd);
+    if((source ? fputs(source->label, stream)
+               : fput_nonnegative_int(fd, stream)) == EOF)
+    {
+        return EOF;
+    }
+    return fputs(" MATCH\n", stream);
+}
+
+
+/*\
+Reads what comes in on the descriptors polled for IN until the pattern
+shows up in it, and reports the match, or with pass, copies everything
+read to stdout instead. Other events, and the end of the data, are
+reported as usual and end the wait. Only a match counts as an asked-for
+event for the exit code.
+\*/
+static
+int wait_for_match(struct pollfd * polls, nfds_t nfds, int timeout,
+                   struct sources const * sources,
+                   struct match const * match, char * arg0)
+{
+    long long deadline = deadline_after(timeout);
+    size_t length = strlen(match->pattern);
+    struct match_buffer * buffers = calloc(nfds,
+                                           sizeof(struct match_buffer));
+    char data[MAX_LINE];
+    regex_t regex;
+    if(!buffers)
+    {
+        return error_allocating_memory(arg0);
+    }
+    if(match->regex
+    && regcomp(&regex, match->pattern, REG_EXTENDED | REG_NOSUB))
+    {
+        return error_bad_option_argument("until-match", match->pattern,
+                                         arg0);
+    }
+    for(;;)
+    {
+        nfds_t index;
+        int stop = 0;
+        int result = wait_for_events(polls, nfds, deadline, sources);
+        if(result < 0)
+        {
+            return error_polling(arg0);
+        }
+        if(!result)
+        {
+            return EXIT_NO_EVENT;
+        }
+        for(index = 0; result; index += 1)
+        {
+            struct pollfd * poll = polls + index;
+            int error;
+            if(!poll->revents)
+            {
+                continue;
+            }
+            result -= 1;
+            if(poll->revents & poll->events & POLLIN
+            && is_stream(poll->fd, sources))
+            {
+                ssize_t count = read(poll->fd, data, sizeof(data));
+                if(count < 0)
+                {
+                    if(errno != EAGAIN && errno != EWOULDBLOCK
+                    && errno != EINTR)
+                    {
+                        return error_reading(arg0);
+                    }
+                    continue;
+                }
+                if(count)
+                {
+                    int matched = match->regex
+                        ? match_regex(&regex, buffers + index, data, count)
+                        : match_literal(match->pattern, length,
+                                        buffers + index, data, count);
+                    if(match->pass
+                    && fwrite(data, 1, count, stdout) != (size_t)count)
+                    {
+                        return error_writing_output(arg0);
+                    }
+                    if(matched)
+                    {
+                        if((!match->pass
+                           && fput_match(poll->fd, sources, stdout) == EOF)
+                        || flush_output(stdout) == EOF)
+                        {
+                            return error_writing_output(arg0);
+                        }
+                        return EXIT_ASKED_EVENT_OR_INFO;
+                    }
+                    continue;
+                }
+            }
+            error = report_poll(poll, sources, arg0);
+            if(error > 0)
+            {
+                return error;
+            }
+            if(!error)
+            {
+                stop = 1;
+            }
+        }
+        if(flush_output(stdout) == EOF)
+        {
+            return error_writing_output(arg0);
+        }
+        if(stop)
+        {
+            return EXIT_UNASKED_EVENT;
+        }
+    }
+}
+#endif
+
+
+/*\
+Keeps polling until the deadline after a wake, so that events which follow
+right after the first ones are reported together with them. Every event is
+only polled for until it is seen, and descriptors that hung up or are
+invalid not at all after that, so that events which stay on don't keep
+waking us up for the rest of the window. Then the polls get back what they
+were polling for, with all the events seen during the window. Returns how
+many polls have events, or -1 with errno set.
+\*/
+static
+int gather_events(struct pollfd * polls, nfds_t nfds, int result,
+                  long long deadline, struct sources const * sources,
+                  struct pollfd * saved)
+{
+    nfds_t index;
+    memcpy(saved, polls, nfds * sizeof(struct pollfd));
+    while(result)
+    {
+        nfds_t left = 0;
+        for(index = 0; index < nfds; index += 1)
+        {
+            struct pollfd * poll = polls + index;
+            saved[index].revents |= poll->revents;
+            poll->events &= ~poll->revents;
+            if(poll->revents & (POLLERR | POLLHUP | POLLNVAL))
+            {
+                poll->fd = -1;
+            }
+            if(poll->fd >= 0)
+            {
+                left += 1;
+            }
+        }
+        /* There is no point in waiting out the window with nothing left. */
+        if(!left)
+        {
+            break;
+        }
+        result = wait_for_events(polls, nfds, deadline, sources);
+        if(result < 0)
+        {
+            return result;
+        }
+    }
+    result = 0;
+    for(index = 0; index < nfds; index += 1)
+    {
+        polls[index].fd = saved[index].fd;
+        polls[index].events = saved[index].events;
+        polls[index].revents = saved[index].revents;
+        if(saved[index].revents)
+        {
+            result += 1;
+        }
+    }
+    return result;
+}
+
+
+/*\
+A trace file is a header and then one record for every descriptor that had
+events on a wake, all of the same size, in the byte order of the machine.
+\*/
+struct trace_record
+{
+    /* CLOCK_MONOTONIC time of the wake, in nanoseconds */
+    int64_t time;
+    /* How long the wait before the wake took, in nanoseconds */
+    int64_t waited;
+    int32_t fd;
+    int16_t events;
+    int16_t revents;
+};
+
+
+struct trace_header
+{
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved[3];
+};
+
+
+/*\
+The file is grown and mapped a chunk at a time, so that adding a record is
+just a copy into memory, with no system call most of the time. Chunks start
+at a whole number of chunks into the file, which is page aligned since a
+chunk is a whole number of pages. Until the trace is closed, the file has
+zeroed records at the end of the chunk, which is also what a crash leaves.
+\*/
+struct trace
+{
+    int fd;
+    char * chunk;
+    off_t chunk_start;
+    /* Where in the file the next record goes. */
+    off_t end;
+};
+
+
+static
+off_t trace_chunk_size(void)
+{
+    return (off_t)sizeof(struct trace_record) * TRACE_CHUNK_RECORDS;
+}
+
+
+static
+int map_trace_chunk(struct trace * trace)
+{
+    off_t size = trace_chunk_size();
+    trace->chunk_start = trace->end / size * size;
+    if(ftruncate(trace->fd, trace->chunk_start + size) < 0)
+    {
+        return -1;
+    }
+    trace->chunk = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        trace->fd, trace->chunk_start);
+    if(trace->chunk == MAP_FAILED)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*\
+Opens a trace file to add records to, starting it with a header if it is
+new. Returns zero, -1 with errno set, -2 if it is not a trace file, or -3
+if another poll is adding to it. Two runs would map the same chunk and
+overwrite each other's records, so the file stays write-locked until the
+trace is closed (the lock goes with the descriptor), and a locked one is
+refused rather than waited for.
+\*/
+static
+int open_trace(char const * path, struct trace * trace)
+{
+    struct trace_header header;
+    struct stat status;
+    struct flock lock;
+    trace->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if(trace->fd < 0)
+    {
+        return -1;
+    }
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    if(fcntl(trace->fd, F_SETLK, &lock) < 0)
+    {
+        return errno == EACCES || errno == EAGAIN ? -3 : -1;
+    }
+    if(fstat(trace->fd, &status) < 0)
+    {
+        return -1;
+    }
+    if(!status.st_size)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.record_size = sizeof(struct trace_record);
+        if(write(trace->fd, &header, sizeof(header)) != sizeof(header))
+        {
+            return -1;
+        }
+        status.st_size = sizeof(header);
+    }
+    else
+    if(read(trace->fd, &header, sizeof(header)) != sizeof(header)
+    || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+    || header.record_size != sizeof(struct trace_record)
+    || (status.st_size - sizeof(header)) % sizeof(struct trace_record))
+    {
+        return -2;
+    }
+    trace->end = status.st_size;
+    /* A run that didn't close the trace leaves zeroed records to reuse. */
+    while(trace->end > (off_t)sizeof(header))
+    {
+        int64_t time;
+        off_t at = trace->end - sizeof(struct trace_record);
+        if(pread(trace->fd, &time, sizeof(time), at) != sizeof(time))
+        {
+            return -1;
+        }
+        if(time)
+        {
+            break;
+        }
+        trace->end = at;
+    }
+    return map_trace_chunk(trace);
+}
+
+
+static
+int add_trace_record(struct trace * trace, long long time,
+                     long long waited, struct pollfd const * poll)
+{
+    struct trace_record record;
+    off_t size = trace_chunk_size();
+    /* The header is one record long, so records never cross chunks. */
+    if(trace->end - trace->chunk_start >= size)
+    {
+        munmap(trace->chunk, size);
+        if(map_trace_chunk(trace) < 0)
+        {
+            return -1;
+        }
+    }
+    record.time = time;
+    record.waited = waited;
+    record.fd = poll->fd;
+    record.events = poll->events;
+    record.revents = poll->revents;
+    memcpy(trace->chunk + (trace->end - trace->chunk_start), &record,
+           sizeof(record));
+    trace->end += sizeof(record);
+    return 0;
+}
+
+
+/* Cuts off the zeroed records after the last one. */
+static
+int close_trace(struct trace * trace)
+{
+    munmap(trace->chunk, trace_chunk_size());
+    if(ftruncate(trace->fd, trace->end) < 0)
+    {
+        return -1;
+    }
+    return close(trace->fd);
+}
+
+
+/* What the waiting took, for --stats. */
+struct stats
+{
+    char const * backend;
+    unsigned int threads;
+    nfds_t descriptors;
+    long long wakes;
+    long long events;
+    /* How long was spent waiting, in nanoseconds. */
+    long long waited;
+};
+
+
+static
+int clamp_long_long(long long value)
+{
+    return value > INT_MAX ? INT_MAX : value;
+}
+
+
+static
+int fput_stats(struct stats const * stats, FILE * stream)
+{
+    if(fputs("stats", stream) == EOF
+    || fputs(" backend=", stream) == EOF
+    || fputs(stats->backend, stream) == EOF
+    || fput_field("threads", stats->threads, stream) == EOF
+    || fput_field("descriptors", clamp_long_long(stats->descriptors),
+                  stream) == EOF
+    || fput_field("wakes", clamp_long_long(stats->wakes), stream) == EOF
+    || fput_field("events", clamp_long_long(stats->events), stream) == EOF
+    || fput_field("waited_us", clamp_long_long(stats->waited / 1000),
+                  stream) == EOF)
+    {
+        return EOF;
+    }
+    return fputc('\n', stream);
+}
+
+
+/* How results are reported, from the options. */
+struct reporting
+{
+    /* Whether to keep reporting until the timeout runs out (--watch). */
+    int watch;
+    /* How long to gather more events after a wake, in microseconds. */
+    int gather;
+    /* How long not to poll a descriptor after reporting it, in ms. */
+    int debounce;
+    /* The most result lines per second, or 0 for no limit. */
+    int max_rate;
+    /* Whether a descriptor is only reported when its events change. */
+    int edge;
+    /* Events after which a descriptor is dropped from the poll set. */
+    short retire;
+    /* The descriptor that commands are read from (--control), or -1. */
+    int control;
+    /* Where to count what the waiting took, for --stats. */
+    struct stats * stats;
+    /* Where to record every wake (--trace), or null. */
+    struct trace * trace;
+};
+
+
+/* What is remembered about each poll for --debounce and --edge. */
+struct quieting
+{
+    int fd;
+    short last;
+    /* When a debounced descriptor is polled for again, or -1. */
+    long long until;
+    /* --edge: milliseconds to leave it out for when its events repeat. */
+    int delay;
+};
+
+
+/* The second of output that --max-rate is counting lines for. */
+struct rate
+{
+    long long second;
+    int lines;
+    /*\
+    Times a descriptor was muted for going over. Muted descriptors are not
+    polled, so how many lines that kept back is not known.
+    \*/
+    int muted;
+};
+
+
+static
+int fput_muted(int muted, FILE * stream)
+{
+    if(fputs("muted ", stream) == EOF
+    || fput_nonnegative_int(muted, stream) == EOF)
+    {
+        return EOF;
+    }
+    return fputc('\n', stream);
+}
+
+
+/*\
+Counts a result line against the rate limit, and returns whether it can be
+written. How many times descriptors were muted instead is written before
+the first line that makes it through after them.
+\*/
+static
+int take_line(struct rate * rate, int max_rate, FILE * stream)
+{
+    long long now = monotonic_nanoseconds();
+    if(now - rate->second >= 1000000000)
+    {
+        rate->second = now;
+        rate->lines = 0;
+    }
+    if(rate->lines >= max_rate)
+    {
+        if(rate->muted < INT_MAX)
+        {
+            rate->muted += 1;
+        }
+        return 0;
+    }
+    rate->lines += 1;
+    if(rate->muted)
+    {
+        if(fput_muted(rate->muted, stream) == EOF)
+        {
+            return EOF;
+        }
+        rate->muted = 0;
+    }
+    return 1;
+}
+
+
+/*\
+Puts debounced descriptors whose time is up back into the poll set, and
+returns when the next one is due, -1 if none are waiting, or -2 with errno
+set. With --edge, each one is checked right away, since one that lost its
+events while it was left out would otherwise look like it still had the
+last ones once it gets them again.
+\*/
+static
+long long unmute_polls(struct pollfd * polls, nfds_t nfds,
+                       struct quieting * quieting, int edge)
+{
+    long long now = monotonic_nanoseconds();
+    long long next = -1;
+    nfds_t index;
+    for(index = 0; index < nfds; index += 1)
+    {
+        struct quieting * quiet = quieting + index;
+        if(quiet->until < 0)
+        {
+            continue;
+        }
+        if(quiet->until <= now)
+        {
+            polls[index].fd = quiet->fd;
+            quiet->until = -1;
+            if(edge)
+            {
+                int result = poll(polls + index, 1, 0);
+                if(result < 0)
+                {
+                    return -2;
+                }
+                if(!result)
+                {
+                    quiet->last = 0;
+                }
+            }
+        }
+        else
+        if(next < 0 || quiet->until < next)
+        {
+            next = quiet->until;
+        }
+    }
+    return next;
+}
+
+
+/*\
+For --edge: forgets the last events of the descriptors that were polled and
+have none now, so that the next events they get are a new edge.
+\*/
+static
+void forget_edges(struct pollfd const * polls, nfds_t nfds,
+                  struct quieting * quieting)
+{
+    nfds_t index;
+    for(index = 0; index < nfds; index += 1)
+    {
+        if(polls[index].fd >= 0 && !polls[index].revents)
+        {
+            quieting[index].last = 0;
+        }
+    }
+}
+
+
+/*\
+For --edge, after a wake was reported: a descriptor only ever wakes us up
+with events, and sources like timers are read when they are reported, so
+to see them without events in between, they have to be checked once more.
+\*/
+static
+int check_edges(struct pollfd * polls, nfds_t nfds,
+                struct quieting * quieting)
+{
+    if(poll(polls, nfds, 0) < 0)
+    {
+        return -1;
+    }
+    forget_edges(polls, nfds, quieting);
+    return 0;
+}
+
+
+/*\
+Prints the result line for a poll, unless --edge or --max-rate say not to,
+and then leaves a debounced descriptor out of the poll set for a while. One
+that is over the --max-rate is left out until the next second of output,
+so that it doesn't keep waking us up just to be held back. With --edge, one
+whose events repeat is left out too, for a delay that grows each time they
+still have not changed, so that events which stay on don't keep us busy.
+Returns zero, or the exit code of an error.
+\*/
+static
+int report_quietly(struct pollfd * poll, struct quieting * quiet,
+                   struct reporting const * reporting, struct rate * rate,
+                   struct sources const * sources, char * arg0)
+{
+    int error;
+    if(reporting->edge)
+    {
+        if(quiet->last == poll->revents)
+        {
+            if(quiet->delay < MIN_RECHECK_DELAY)
+            {
+                quiet->delay = MIN_RECHECK_DELAY;
+            }
+            quiet->until = monotonic_nanoseconds()
+                         + (long long)quiet->delay * 1000000;
+            quiet->delay *= 2;
+            if(quiet->delay > MAX_RECHECK_DELAY)
+            {
+                quiet->delay = MAX_RECHECK_DELAY;
+            }
+            poll->fd = -1;
+            return 0;
+        }
+        quiet->last = poll->revents;
+        quiet->delay = MIN_RECHECK_DELAY;
+    }
+    if(reporting->max_rate)
+    {
+        int print = take_line(rate, reporting->max_rate, stdout);
+        if(print == EOF)
+        {
+            return error_writing_output(arg0);
+        }
+        if(!print)
+        {
+            quiet->until = rate->second + 1000000000;
+            poll->fd = -1;
+            return 0;
+        }
+    }
+    error = print_poll(poll, sources, arg0);
+    if(error)
+    {
+        return error;
+    }
+    if(reporting->debounce)
+    {
+        quiet->until = monotonic_nanoseconds()
+                     + (long long)reporting->debounce * 1000000;
+        poll->fd = -1;
+    }
+    return 0;
+}
+
+
+/*\
+The polls that wait_and_report waits for, with what it remembers about each
+of them. They stay sorted by descriptor (the one in quieting, since a muted
+or retired poll's own is -1), so that the control channel can find, add and
+remove them in place, without sorting and merging them all over again.
+\*/
+struct watch_set
+{
+    struct pollfd * polls;
+    struct quieting * quieting;
+    /* Room to gather events in (--gather), or null. */
+    struct pollfd * saved;
+    nfds_t count;
+    /* How many polls are not retired (not counting the control one). */
+    nfds_t live;
+    /* The control channel's descriptor, or -1 once it is closed. */
+    int control;
+};
+
+
+/* Returns the index of the first poll for the descriptor or a higher one. */
+static
+nfds_t find_watched(struct watch_set const * set, int fd)
+{
+    nfds_t low = 0;
+    nfds_t high = set->count;
+    while(low < high)
+    {
+        nfds_t middle = low + (high - low) / 2;
+        if(set->quieting[middle].fd < fd)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+
+static
+int is_retired(struct watch_set const * set, nfds_t index)
+{
+    return set->polls[index].fd < 0 && set->quieting[index].until < 0;
+}
+
+
+/*\
+Starts watching for events on a descriptor, or for more events if it is
+already watched, which also brings it back if it was retired. Returns zero,
+or -1 if memory could not be allocated.
+\*/
+static
+int add_watched(struct watch_set * set, int fd, short events)
+{
+    nfds_t index = find_watched(set, fd);
+    nfds_t after;
+    struct pollfd * polls;
+    struct quieting * quieting;
+    if(index < set->count && set->quieting[index].fd == fd)
+    {
+        if(is_retired(set, index))
+        {
+            set->polls[index].fd = fd;
+            set->polls[index].events = 0;
+            set->live += 1;
+        }
+        set->polls[index].events |= events;
+        return 0;
+    }
+    /*\
+    Each array is only replaced once it has grown, so that the set stays
+    whole if one can't. quieting keeps the one extra entry that it was
+    allocated with, in case the set started out empty.
+    \*/
+    polls = realloc(set->polls, (set->count + 1) * sizeof(struct pollfd));
+    if(!polls)
+    {
+        return -1;
+    }
+    set->polls = polls;
+    quieting = realloc(set->quieting,
+                       (set->count + 2) * sizeof(struct quieting));
+    if(!quieting)
+    {
+        return -1;
+    }
+    set->quieting = quieting;
+    if(set->saved)
+    {
+        struct pollfd * saved = realloc(set->saved, (set->count + 1)
+                                                    * sizeof(struct pollfd));
+        if(!saved)
+        {
+            return -1;
+        }
+        set->saved = saved;
+    }
+    after = set->count - index;
+    memmove(set->polls + index + 1, set->polls + index,
+            after * sizeof(struct pollfd));
+    memmove(set->quieting + index + 1, set->quieting + index,
+            after * sizeof(struct quieting));
+    set->polls[index].fd = fd;
+    set->polls[index].events = events;
+    set->polls[index].revents = 0;
+    set->quieting[index].fd = fd;
+    set->quieting[index].last = 0;
+    set->quieting[index].until = -1;
+    set->quieting[index].delay = 0;
+    set->count += 1;
+    set->live += 1;
+    return 0;
+}
+
+
+static
+void remove_watched(struct watch_set * set, int fd)
+{
+    nfds_t index = find_watched(set, fd);
+    nfds_t after;
+    if(index >= set->count || set->quieting[index].fd != fd)
+    {
+        return;
+    }
+    if(!is_retired(set, index) && fd != set->control)
+    {
+        set->live -= 1;
+    }
+    set->count -= 1;
+    after = set->count - index;
+    memmove(set->polls + index, set->polls + index + 1,
+            after * sizeof(struct pollfd));
+    memmove(set->quieting + index, set->quieting + index + 1,
+            after * sizeof(struct quieting));
+}
+
+
+/*\
+Splits a command into its words, in place. Returns how many there are.
+\*/
+static
+size_t split_words(char * line, char * * words)
+{
+    size_t count = 0;
+    for(;;)
+    {
+        while(*line == ' ' || *line == '\t')
+        {
+            *line++ = '\0';
+        }
+        if(!*line)
+        {
+            return count;
+        }
+        words[count] = line;
+        count += 1;
+        while(*line && *line != ' ' && *line != '\t')
+        {
+            line += 1;
+        }
+    }
+}
+
+
+/*\
+Adds the descriptors of an `add` command, which are given like in the
+arguments: each group of descriptors is followed by the events for them.
+Only plain descriptors can be added, since sources and conditions would
+need room that is only made for what is in the arguments.
+\*/
+static
+int add_watched_groups(struct watch_set * set, char * * words, size_t count)
+{
+    int fds[MAX_LINE / 2];
+    size_t group = 0;
+    short events = 0;
+    size_t index;
+    if(!count)
+    {
+        return 1;
+    }
+    /* Parse everything first, so that a bad command does nothing at all. */
+    for(index = 0; index < count; index += 1)
+    {
+        if(!parse_nonnegative_int(words[index], fds + index))
+        {
+            if(!index || !parse_event(words[index]))
+            {
+                return 1;
+            }
+            fds[index] = -1;
+        }
+    }
+    for(index = 0; index <= count; index += 1)
+    {
+        if(index < count && fds[index] < 0)
+        {
+            events |= parse_event(words[index]);
+            continue;
+        }
+        if(index == count || (index && fds[index - 1] < 0))
+        {
+            for(; group < index; group += 1)
+            {
+                if(fds[group] >= 0
+                && add_watched(set, fds[group], events) < 0)
+                {
+                    return -1;
+                }
+            }
+            events = 0;
+        }
+    }
+    return 0;
+}
+
+
+/*\
+Carries out one command from the control channel:
+
+    add <fd>... [<event>]... ...
+    del <fd>...
+    timeout <ms>
+
+Returns zero, 1 if the command is bad, or -1 if memory could not be
+allocated.
+\*/
+static
+int run_control_command(struct watch_set * set, char * line,
+                        long long * deadline)
+{
+    char * words[MAX_LINE / 2 + 1];
+    size_t count = split_words(line, words);
+    size_t index;
+    int timeout;
+    if(!count)
+    {
+        return 0;
+    }
+    if(!strcmp(words[0], "add"))
+    {
+        return add_watched_groups(set, words + 1, count - 1);
+    }
+    if(!strcmp(words[0], "del") && count > 1)
+    {
+        int fd;
+        for(index = 1; index < count; index += 1)
+        {
+            if(!parse_nonnegative_int(words[index], &fd))
+            {
+                return 1;
+            }
+        }
+        for(index = 1; index < count; index += 1)
+        {
+            parse_nonnegative_int(words[index], &fd);
+            remove_watched(set, fd);
+        }
+        return 0;
+    }
+    if(!strcmp(words[0], "timeout") && count == 2
+    && parse_nonnegative_int(words[1], &timeout))
+    {
+        *deadline = deadline_after(timeout);
+        return 0;
+    }
+    return 1;
+}
+
+
+/* Commands read so far from the control channel, up to a partial line. */
+struct control_buffer
+{
+    size_t length;
+    char bytes[MAX_LINE + 1];
+};
+
+
+/*\
+Reads what is there on the control channel, and carries out every whole
+line in it. Returns zero, 1 if the control channel is closed, or -1 with
+errno set.
+\*/
+static
+int read_control(int fd, struct control_buffer * buffer,
+                 struct watch_set * set, long long * deadline, char * arg0)
+{
+    char * line;
+    char * end;
+    ssize_t count = read(fd, buffer->bytes + buffer->length,
+                         MAX_LINE - buffer->length);
+    if(count < 0)
+    {
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+    }
+    if(!count)
+    {
+        return 1;
+    }
+    buffer->length += count;
+    buffer->bytes[buffer->length] = '\0';
+    line = buffer->bytes;
+    while((end = strchr(line, '\n')))
+    {
+        int status;
+        char command[MAX_LINE + 1];
+        *end = '\0';
+        strcpy(command, line);
+        status = run_control_command(set, line, deadline);
+        if(status < 0)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        if(status)
+        {
+            error_bad_control_command(command, arg0);
+        }
+        line = end + 1;
+    }
+    buffer->length -= line - buffer->bytes;
+    /* A line too long to ever be a command is thrown away. */
+    if(buffer->length == MAX_LINE)
+    {
+        error_bad_control_command("(too long)", arg0);
+        buffer->length = 0;
+    }
+    memmove(buffer->bytes, line, buffer->length);
+    return 0;
+}
+
+
+/*\
+Waits for events and reports them - just once, or in watch mode, over and
+over until the timeout runs out. With a gather window, every wake is
+followed by gathering more events for a while. A debounced descriptor is
+left out of the poll set for a while after it was reported, so that events
+which stay on don't keep waking us up and printing the same line, and a
+retired one for good - once none are left, there is nothing to wait for,
+and the exit code is the one for what was reported. Sources which have
+nothing to report yet (like a connection which is going to be retried)
+don't end the wait. Commands from the control channel are carried out
+between waits, and the polls are reallocated as they need, so they must
+have been allocated on their own.
+\*/
+static
+int wait_and_report(struct pollfd * polls, nfds_t nfds, int timeout,
+                    struct sources const * sources,
+                    struct reporting const * reporting, char * arg0)
+{
+    long long deadline = deadline_after(timeout);
+    int exitcode = EXIT_NO_EVENT;
+    int reported = 0;
+    struct watch_set set;
+    struct control_buffer * control;
+    struct rate rate = {0, 0, 0};
+    nfds_t index;
+    set.polls = polls;
+    set.count = nfds;
+    set.saved = 0;
+    set.live = 0;
+    set.control = reporting->control;
+    if(reporting->gather)
+    {
+        set.saved = calloc(nfds, sizeof(struct pollfd));
+        if(!set.saved)
+        {
+            return error_allocating_memory(arg0);
+        }
+    }
+    /* calloc(0) may return null, so there is always one more. */
+    set.quieting = calloc(nfds + 1, sizeof(struct quieting));
+    if(!set.quieting)
+    {
+        return error_allocating_memory(arg0);
+    }
+    for(index = 0; index < nfds; index += 1)
+    {
+        set.quieting[index].fd = polls[index].fd;
+        set.quieting[index].until = -1;
+        if(polls[index].fd >= 0 && polls[index].fd != reporting->control)
+        {
+            set.live += 1;
+        }
+    }
+    control = calloc(1, sizeof(struct control_buffer));
+    if(!control)
+    {
+        return error_allocating_memory(arg0);
+    }
+    rate.second = monotonic_nanoseconds();
+    do
+    {
+        long long wake = deadline;
+        long long started;
+        long long woke;
+        short control_events = 0;
+        int result;
+        if(reporting->debounce || reporting->max_rate || reporting->edge)
+        {
+            long long unmute = unmute_polls(set.polls, set.count,
+                                            set.quieting, reporting->edge);
+            if(unmute == -2)
+            {
+                return error_polling(arg0);
+            }
+            if(unmute >= 0 && (wake < 0 || unmute < wake))
+            {
+                wake = unmute;
+            }
+        }
+        started = monotonic_nanoseconds();
+        result = wait_for_events(set.polls, set.count, wake, sources);
+        woke = monotonic_nanoseconds();
+        reporting->stats->waited += woke - started;
+        if(result < 0)
+        {
+            return error_polling(arg0);
+        }
+        if(!result)
+        {
+            if(wake == deadline)
+            {
+                break;
+            }
+            if(reporting->edge)
+            {
+                forget_edges(set.polls, set.count, set.quieting);
+            }
+            continue;
+        }
+        if(reporting->gather)
+        {
+            long long window = monotonic_nanoseconds()
+                             + (long long)reporting->gather * 1000;
+            if(wake >= 0 && wake < window)
+            {
+                window = wake;
+            }
+            result = gather_events(set.polls, set.count, result, window,
+                                   sources, set.saved);
+            if(result < 0)
+            {
+                return error_polling(arg0);
+            }
+        }
+        reporting->stats->wakes += 1;
+        reporting->stats->events += result;
+        reported = 0;
+        for(index = next_ready_poll(set.polls, 0, set.count); result;
+            index = next_ready_poll(set.polls, index + 1, set.count))
+        {
+            struct pollfd * poll = set.polls + index;
+            int error;
+            result -= 1;
+            if(reporting->trace
+            && add_trace_record(reporting->trace, woke, woke - started,
+                                poll) < 0)
+            {
+                return error_tracing(arg0);
+            }
+            if(poll->fd == set.control)
+            {
+                control_events = poll->revents;
+                continue;
+            }
+            error = consume_poll(poll, sources, arg0);
+            if(error > 0)
+            {
+                return error;
+            }
+            if(error)
+            {
+                continue;
+            }
+            reported = 1;
+            error = report_quietly(poll, set.quieting + index, reporting,
+                                   &rate, sources, arg0);
+            if(error)
+            {
+                return error;
+            }
+            exitcode = update_exitcode(exitcode, poll);
+            if(poll->revents & reporting->retire)
+            {
+                poll->fd = -1;
+                set.quieting[index].until = -1;
+                set.live -= 1;
+            }
+        }
+        if(reporting->edge
+        && check_edges(set.polls, set.count, set.quieting) < 0)
+        {
+            return error_polling(arg0);
+        }
+        if(reporting->watch && flush_output(stdout) == EOF)
+        {
+            return error_writing_output(arg0);
+        }
+        /*\
+        The control channel goes last, because its commands can move the
+        polls around. Once it is closed, the watch goes on without it.
+        \*/
+        if(control_events)
+        {
+            int status = read_control(set.control, control, &set,
+                                      &deadline, arg0);
+            if(status < 0)
+            {
+                return error_reading(arg0);
+            }
+            if(status || control_events & (POLLERR | POLLNVAL))
+            {
+                remove_watched(&set, set.control);
+                set.control = -1;
+            }
+        }
+        /*\
+        Events that stay on never let a wait run out, so the timeout has
+        to be checked here too.
+        \*/
+        if(deadline >= 0 && monotonic_nanoseconds() >= deadline)
+        {
+            break;
+        }
+    }
+    while((set.live || set.control >= 0)
+       && (reporting->watch || !reported));
+    if(rate.muted && fput_muted(rate.muted, stdout) == EOF)
+    {
+        return error_writing_output(arg0);
+    }
+    return exitcode;
+}
+
+
+#ifdef LINUX_EXTENSIONS
+/*\
+Picks how many threads to wait with, for --backend=auto (or threads, which
+is forced to use them). Threads only pay off when there are a lot of
+descriptors to go through on every wait of a watch: waiting just once, they
+would cost a poll of every descriptor more than poll itself does, on top of
+starting them. There is no point in more of them than there are cores. The
+number of cores is all that needs probing, which is one cheap call.
+\*/
+static
+unsigned int choose_threads(nfds_t nfds, int looping, int forced)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    nfds_t wanted = nfds / AUTO_THREAD_DESCRIPTORS;
+    if(cores > MAX_THREADS)
+    {
+        cores = MAX_THREADS;
+    }
+    if(forced)
+    {
+        return cores < 2 ? 2 : cores;
+    }
+    if(!looping)
+    {
+        return 1;
+    }
+    if(wanted > (nfds_t)cores)
+    {
+        wanted = cores;
+    }
+    return wanted < 2 ? 1 : wanted;
+}
+
+
+/*\
+A shard is a part of the polls that a thread of its own waits for. After
+every wake, the thread hands its polls over to the main thread (which does
+all the reporting) through its ready pipe, and waits for them back on its
+resume pipe, so the two never use the polls at the same time. That takes
+no locks, since the pipes order everything. Every shard polls the read end
+of the stop pipe too, and writing to it once ends all of them.
+\*/
+struct shard
+{
+    pthread_t thread;
+    /* The shard's polls, and then the one for the stop pipe. */
+    struct pollfd * polls;
+    nfds_t nfds;
+    struct quieting * quieting;
+    long long deadline;
+    /* When the next wait ends: the deadline, or sooner to unmute polls. */
+    long long wake;
+    int ready[2];
+    int resume[2];
+    /* What the last wait returned, and errno if it failed. */
+    int result;
+    int error;
+    /* When the last wait ended, and how long it took, for --trace. */
+    long long woke;
+    long long waited;
+};
+
+
+static
+int write_byte(int fd)
+{
+    char byte = 0;
+    ssize_t written;
+    do
+    {
+        written = write(fd, &byte, 1);
+    }
+    while(written < 0 && errno == EINTR);
+    return written;
+}
+
+
+static
+int read_byte(int fd)
+{
+    char byte;
+    ssize_t count;
+    do
+    {
+        count = read(fd, &byte, 1);
+    }
+    while(count < 0 && errno == EINTR);
+    return count;
+}
+
+
+static
+void * run_shard(void * argument)
+{
+    struct shard * shard = argument;
+    for(;;)
+    {
+        long long started = monotonic_nanoseconds();
+        shard->result = poll_until(shard->polls, shard->nfds + 1,
+                                   shard->wake);
+        shard->error = errno;
+        shard->woke = monotonic_nanoseconds();
+        shard->waited = shard->woke - started;
+        if(shard->result > 0 && shard->polls[shard->nfds].revents)
+        {
+            return 0;
+        }
+        if(write_byte(shard->ready[1]) < 0 || shard->result < 0)
+        {
+            return 0;
+        }
+        /* The main thread closes the resume pipe to end the shard. */
+        if(read_byte(shard->resume[0]) <= 0)
+        {
+            return 0;
+        }
+    }
+}
+
+
+/*\
+Makes a pipe between threads, with both ends moved above the descriptors
+in the arguments, like the ones of children. The reading end stays
+blocking, since a thread waits on it.
+\*/
+static
+int make_thread_pipe(int ends[2], int minimum)
+{
+    if(pipe(ends) < 0
+    || (ends[0] = move_descriptor(ends[0], minimum)) < 0
+    || (ends[1] = move_descriptor(ends[1], minimum)) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+static
+int start_shard(struct shard * shard, struct pollfd const * polls,
+                nfds_t nfds, int stop, long long deadline, int minimum)
+{
+    nfds_t index;
+    shard->polls = calloc(nfds + 1, sizeof(struct pollfd));
+    shard->quieting = calloc(nfds, sizeof(struct quieting));
+    if(!shard->polls || !shard->quieting)
+    {
+        return -1;
+    }
+    memcpy(shard->polls, polls, nfds * sizeof(struct pollfd));
+    shard->polls[nfds].fd = stop;
+    shard->polls[nfds].events = POLLIN;
+    for(index = 0; index < nfds; index += 1)
+    {
+        shard->quieting[index].fd = polls[index].fd;
+        shard->quieting[index].until = -1;
+    }
+    shard->nfds = nfds;
+    shard->deadline = deadline;
+    shard->wake = deadline;
+    if(make_thread_pipe(shard->ready, minimum) < 0
+    || make_thread_pipe(shard->resume, minimum) < 0)
+    {
+        return -1;
+    }
+    errno = pthread_create(&shard->thread, 0, run_shard, shard);
+    return errno ? -1 : 0;
+}
+
+
+static
+void stop_shards(struct shard * shards, unsigned int count, int stop)
+{
+    unsigned int index;
+    write_byte(stop);
+    for(index = 0; index < count; index += 1)
+    {
+        close(shards[index].resume[1]);
+        pthread_join(shards[index].thread, 0);
+    }
+}
+
+
+/*\
+Reports the polls of a shard which have events, the way wait_and_report
+does, and retires them like it. Returns zero, or the exit code of an error.
+\*/
+static
+int report_shard(struct shard * shard, struct reporting const * reporting,
+                 struct rate * rate, struct sources const * sources,
+                 int * exitcode, nfds_t * live, char * arg0)
+{
+    nfds_t poll;
+    for(poll = next_ready_poll(shard->polls, 0, shard->nfds);
+        poll < shard->nfds;
+        poll = next_ready_poll(shard->polls, poll + 1, shard->nfds))
+    {
+        struct pollfd * reported = shard->polls + poll;
+        int error;
+        if(reporting->trace
+        && add_trace_record(reporting->trace, shard->woke, shard->waited,
+                            reported) < 0)
+        {
+            return error_tracing(arg0);
+        }
+        error = report_quietly(reported, shard->quieting + poll, reporting,
+                               rate, sources, arg0);
+        if(error)
+        {
+            return error;
+        }
+        *exitcode = update_exitcode(*exitcode, reported);
+        if(reported->revents & reporting->retire)
+        {
+            reported->fd = -1;
+            *live -= 1;
+        }
+    }
+    return 0;
+}
+
+
+/*\
+Like wait_and_report, but with the polls split up between threads, which
+each wait for their own part. Every thread's wake is reported by the main
+thread, so the output is the same as without threads, but the kernel's
+work of going through a big set of descriptors is spread across cores.
+Only plain descriptors can be waited for this way, since sources and
+conditions are not made to be used by several threads.
+\*/
+static
+int wait_in_threads(struct pollfd * polls, nfds_t nfds, int timeout,
+                    struct sources const * sources,
+                    struct reporting const * reporting, unsigned int threads,
+                    char * arg0)
+{
+    long long deadline = deadline_after(timeout);
+    int exitcode = EXIT_NO_EVENT;
+    struct rate rate = {0, 0, 0};
+    struct shard * shards;
+    struct pollfd * readies;
+    unsigned int count = threads < nfds ? threads : nfds;
+    unsigned int active = count;
+    nfds_t size = (nfds + count - 1) / count;
+    nfds_t live = 0;
+    int done = 0;
+    /* When the wait ended and how long it took, when waiting once. */
+    long long woke = 0;
+    long long waited = 0;
+    int stop[2];
+    unsigned int index;
+    reporting->stats->threads = count;
+    shards = calloc(count, sizeof(struct shard));
+    readies = calloc(count, sizeof(struct pollfd));
+    if(!shards || !readies)
+    {
+        return error_allocating_memory(arg0);
+    }
+    if(make_thread_pipe(stop, sources->minimum) < 0)
+    {
+        return error_starting_threads(arg0);
+    }
+    for(index = 0; index < count; index += 1)
+    {
+        nfds_t start = index * size;
+        nfds_t length = nfds - start < size ? nfds - start : size;
+        if(start_shard(shards + index, polls + start, length, stop[0],
+                       deadline, sources->minimum) < 0)
+        {
+            int error = error_starting_threads(arg0);
+            stop_shards(shards, index, stop[1]);
+            return error;
+        }
+        readies[index].fd = shards[index].ready[0];
+        readies[index].events = POLLIN;
+    }
+    for(index = 0; index < nfds; index += 1)
+    {
+        if(polls[index].fd >= 0)
+        {
+            live += 1;
+        }
+    }
+    rate.second = monotonic_nanoseconds();
+    while(active && live && !done)
+    {
+        /* The shards time out on their own. */
+        long long started = monotonic_nanoseconds();
+        int result = poll_until(readies, count, -1);
+        reporting->stats->waited += monotonic_nanoseconds() - started;
+        if(result < 0)
+        {
+            int error = error_polling(arg0);
+            stop_shards(shards, count, stop[1]);
+            return error;
+        }
+        for(index = 0; index < count && result; index += 1)
+        {
+            struct shard * shard = shards + index;
+            int error;
+            if(!readies[index].revents)
+            {
+                continue;
+            }
+            result -= 1;
+            read_byte(shard->ready[0]);
+            if(shard->result < 0)
+            {
+                errno = shard->error;
+                error = error_polling(arg0);
+                stop_shards(shards, count, stop[1]);
+                return error;
+            }
+            if(!shard->result && shard->wake == shard->deadline)
+            {
+                readies[index].fd = -1;
+                active -= 1;
+                continue;
+            }
+            if(!reporting->watch)
+            {
+                woke = shard->woke;
+                waited = shard->waited;
+                done = 1;
+                break;
+            }
+            if(shard->result)
+            {
+                reporting->stats->wakes += 1;
+                reporting->stats->events += shard->result;
+            }
+            error = report_shard(shard, reporting, &rate, sources, &exitcode,
+                                 &live, arg0);
+            if(error)
+            {
+                stop_shards(shards, count, stop[1]);
+                return error;
+            }
+            if(reporting->edge
+            && check_edges(shard->polls, shard->nfds, shard->quieting) < 0)
+            {
+                error = error_polling(arg0);
+                stop_shards(shards, count, stop[1]);
+                return error;
+            }
+            /* Polls muted by --max-rate or --edge wake their shard. */
+            if(reporting->max_rate || reporting->edge)
+            {
+                long long unmute = unmute_polls(shard->polls, shard->nfds,
+                                                shard->quieting,
+                                                reporting->edge);
+                if(unmute == -2)
+                {
+                    error = error_polling(arg0);
+                    stop_shards(shards, count, stop[1]);
+                    return error;
+                }
+                shard->wake = shard->deadline;
+                if(unmute >= 0 && (shard->wake < 0 || unmute < shard->wake))
+                {
+                    shard->wake = unmute;
+                }
+            }
+            if(write_byte(shard->resume[1]) < 0)
+            {
+                error = error_starting_threads(arg0);
+                stop_shards(shards, count, stop[1]);
+                return error;
+            }
+        }
+        if(reporting->watch && flush_output(stdout) == EOF)
+        {
+            stop_shards(shards, count, stop[1]);
+            return error_writing_output(arg0);
+        }
+        if(deadline >= 0 && monotonic_nanoseconds() >= deadline)
+        {
+            break;
+        }
+    }
+    stop_shards(shards, count, stop[1]);
+    /*\
+    When waiting once, the first shard to wake ends the wait, but the others
+    may have events by then too, so every shard is polled once more without
+    waiting, and all of them are reported as the one wake.
+    \*/
+    if(done)
+    {
+        reporting->stats->wakes += 1;
+        for(index = 0; index < count; index += 1)
+        {
+            struct shard * shard = shards + index;
+            int error;
+            shard->result = poll(shard->polls, shard->nfds, 0);
+            if(shard->result < 0)
+            {
+                return error_polling(arg0);
+            }
+            shard->woke = woke;
+            shard->waited = waited;
+            reporting->stats->events += shard->result;
+            error = report_shard(shard, reporting, &rate, sources, &exitcode,
+                                 &live, arg0);
+            if(error)
+            {
+                return error;
+            }
+        }
+    }
+    if(rate.muted && fput_muted(rate.muted, stdout) == EOF)
+    {
+        return error_writing_output(arg0);
+    }
+    return exitcode;
+}
+#endif
+
+
+/*\
+Waits until enough descriptors have had events that were asked for. Each
+descriptor is reported once, the first time it has events, and is then
+dropped from the poll set. One which only had events that were not asked
+for (like HUP) can't count any more either, so when there are not enough
+descriptors left to make up the number, there is no point in waiting.
+\*/
+static
+int wait_for_quorum(struct pollfd * polls, nfds_t nfds, int timeout,
+                    struct sources const * sources, nfds_t needed,
+                    char * arg0)
+{
+    long long deadline = deadline_after(timeout);
+    nfds_t ready = 0;
+    nfds_t left = nfds;
+    while(ready < needed)
+    {
+        nfds_t index;
+        int result;
+        if(ready + left < needed)
+        {
+            return EXIT_UNASKED_EVENT;
+        }
+        result = wait_for_events(polls, nfds, deadline, sources);
+        if(result < 0)
+        {
+            return error_polling(arg0);
+        }
+        if(!result)
+        {
+            return EXIT_NO_EVENT;
+        }
+        for(index = 0; result; index += 1)
+        {
+            struct pollfd * poll = polls + index;
+            int error;
+            if(!poll->revents)
+            {
+                continue;
+            }
+            result -= 1;
+            error = report_poll(poll, sources, arg0);
+            if(error > 0)
+            {
+                return error;
+            }
+            if(error)
+            {
+                continue;
+            }
+            if(poll->revents & poll->events)
+            {
+                ready += 1;
+            }
+            poll->fd = -1;
+            left -= 1;
+        }
+        if(flush_output(stdout) == EOF)
+        {
+            return error_writing_output(arg0);
+        }
+    }
+    return EXIT_ASKED_EVENT_OR_INFO;
+}
+
+
+/*\
+Waits until the expression holds, remembering every event that was seen on
+each descriptor, and no longer polling for an event once it was seen (or
+for a descriptor at all once it has hung up or is invalid), so that events
+which stay on don't keep waking us. Then, or when the timeout runs out,
+every descriptor with events is reported once, with all of them.
+\*/
+static
+int wait_for_expression(struct pollfd * polls, nfds_t nfds, int timeout,
+                        struct sources const * sources,
+                        struct expression const * expression, char * arg0)
+{
+    long long deadline = deadline_after(timeout);
+    short * seen = calloc(nfds, sizeof(short));
+    int * fds = calloc(nfds, sizeof(int));
+    int * stack = calloc(expression->count, sizeof(int));
+    nfds_t index;
+    int holds;
+    int reported = 0;
+    if(!seen || !fds || !stack)
+    {
+        return error_allocating_memory(arg0);
+    }
+    for(index = 0; index < nfds; index += 1)
+    {
+        fds[index] = polls[index].fd;
+    }
+    holds = evaluate_expression(expression, fds, seen, nfds, stack);
+    while(!holds)
+    {
+        int result = wait_for_events(polls, nfds, deadline, sources);
+        if(result < 0)
+        {
+            return error_polling(arg0);
+        }
+        if(!result)
+        {
+            break;
+        }
+        for(index = 0; result; index += 1)
+        {
+            struct pollfd * poll = polls + index;
+            int error;
+            if(!poll->revents)
+            {
+                continue;
+            }
+            result -= 1;
+            error = consume_poll(poll, sources, arg0);
+            if(error > 0)
+            {
+                return error;
+            }
+            if(error)
+            {
+                continue;
+            }
+            seen[index] |= poll->revents;
+            poll->events &= ~poll->revents;
+            if(poll->revents & (POLLERR | POLLHUP | POLLNVAL))
+            {
+                poll->fd = -1;
+            }
+        }
+        holds = evaluate_expression(expression, fds, seen, nfds, stack);
+    }
+    for(index = 0; index < nfds; index += 1)
+    {
+        struct pollfd poll;
+        int error;
+        if(!seen[index])
+        {
+            continue;
+        }
+        poll.fd = fds[index];
+        poll.events = 0;
+        poll.revents = seen[index];
+        error = print_poll(&poll, sources, arg0);
+        if(error)
+        {
+            return error;
+        }
+        reported = 1;
+    }
+    /* Events that didn't make the expression hold weren't what was asked. */
+    if(holds)
+    {
+        return EXIT_ASKED_EVENT_OR_INFO;
+    }
+    return reported ? EXIT_UNASKED_EVENT : EXIT_NO_EVENT;
+}
+
+
+/*\
+A stage is one wait of a sequence. Its polls are a slice of the whole poll
+array, and its conditions a slice of the conditions of all the sources.
+\*/
+struct stage
+{
+    char * * argv;
+    char * timeout_arg;
+    int timeout;
+    struct pollfd * polls;
+    nfds_t nfds;
+    struct condition * conditions;
+    unsigned int condition_count;
+};
+
+
+static
+int is_then(char const * arg)
+{
+    return !strncmp(arg, "--then", 6) && (!arg[6] || arg[6] == '=');
+}
+
+
+/*\
+Splits the arguments into stages at every `--then`, ending each stage's
+arguments there. Returns the number of stages.
+\*/
+static
+unsigned int split_stages(char * * argv, struct stage * stages)
+{
+    unsigned int count = 1;
+    stages[0].argv = argv;
+    stages[0].timeout_arg = 0;
+    for(; *argv; argv += 1)
+    {
+        if(is_then(*argv))
+        {
+            char * timeout_arg = (*argv)[6] ? *argv + 7 : 0;
+            *argv = 0;
+            stages[count].argv = argv + 1;
+            stages[count].timeout_arg = timeout_arg;
+            count += 1;
+        }
+    }
+    return count;
+}
+
+
+/*\
+Parses the arguments of a stage into its slice of the polls, which starts
+right after the previous stage's. Its conditions are parsed on their own
+too, so that they don't get merged into an earlier stage's conditions for
+the same descriptor.
+\*/
+static
+int parse_stage(struct stage * stage, struct pollfd * polls,
+                struct sources * sources, int timeout, char * arg0)
+{
+    struct condition * conditions = sources->conditions;
+    unsigned int condition_count = sources->condition_count;
+    int error;
+    stage->timeout = timeout;
+    if(stage->timeout_arg
+    && !parse_nonnegative_int(stage->timeout_arg, &stage->timeout))
+    {
+        return error_bad_option_argument("then", stage->timeout_arg, arg0);
+    }
+    if(!*stage->argv)
+    {
+        return error_need_descriptor_or_event(arg0);
+    }
+    stage->polls = polls;
+    stage->nfds = 0;
+    sources->conditions += condition_count;
+    sources->condition_count = 0;
+    error = parse_polls(stage->argv, polls, &stage->nfds, sources, arg0);
+    if(error)
+    {
+        return error;
+    }
+    stage->conditions = sources->conditions;
+    stage->condition_count = sources->condition_count;
+    sources->conditions = conditions;
+    sources->condition_count = condition_count + stage->condition_count;
+    stage->nfds = sort_and_merge_polls(polls, stage->nfds);
+    return 0;
+}
+
+
+/*\
+Waits for each stage in turn, like a separate poll would, and stops at the
+first one that does not get events that were asked for.
+\*/
+static
+int run_stages(struct stage const * stages, unsigned int stage_count,
+               struct sources const * sources,
+               struct reporting const * reporting, char * arg0)
+{
+    unsigned int index;
+    for(index = 0; index < stage_count; index += 1)
+    {
+        struct stage const * stage = stages + index;
+        struct sources stage_sources = *sources;
+        int exitcode;
+        stage_sources.conditions = stage->conditions;
+        stage_sources.condition_count = stage->condition_count;
+        exitcode = wait_and_report(stage->polls, stage->nfds, stage->timeout,
+                                   &stage_sources, reporting, arg0);
+        if(flush_output(stdout) == EOF)
+        {
+            return error_writing_output(arg0);
+        }
+        if(exitcode != EXIT_ASKED_EVENT_OR_INFO)
+        {
+            return exitcode;
+        }
+    }
+    return EXIT_ASKED_EVENT_OR_INFO;
+}
+
+
+/*\
+Closes the trace and writes the stats, once the waiting is done. A trace
+that can't be finished only changes the exit code if nothing else failed.
+\*/
+static
+int finish_waiting(int exitcode, struct reporting const * reporting,
+                   int print_stats, char * arg0)
+{
+    if(reporting->trace && close_trace(reporting->trace) < 0
+    && exitcode < EXIT_USAGE_ERROR)
+    {
+        exitcode = error_tracing(arg0);
+    }
+    if(print_stats)
+    {
+        fput_stats(reporting->stats, stderr);
+    }
+    return exitcode;
+}
+
+
+/*\
+Returns the first option given that only plain waiting and stages do
+anything with, or null, for rejecting them in the other ways of waiting.
+\*/
+static
+char * reporting_option(struct reporting const * reporting, int print_stats)
+{
+    if(reporting->watch)
+    {
+        return "--watch";
+    }
+    if(reporting->gather)
+    {
+        return "--gather";
+    }
+    if(reporting->debounce)
+    {
+        return "--debounce";
+    }
+    if(reporting->max_rate)
+    {
+        return "--max-rate";
+    }
+    if(reporting->edge)
+    {
+        return "--edge";
+    }
+    if(reporting->retire)
+    {
+        return "--retire";
+    }
+    if(print_stats)
+    {
+        return "--stats";
+    }
+    return 0;
+}
+
+
+/*\
+Returns the option for the second of the other ways of waiting that was
+given, or null if at most one was. Each of them takes over the whole wait,
+so they can't be combined.
+\*/
+static
+char * second_mode(char * const * modes, size_t count)
+{
+    size_t index;
+    int given = 0;
+    for(index = 0; index < count; index += 1)
+    {
+        if(!modes[index])
+        {
+            continue;
+        }
+        if(given)
+        {
+            return modes[index];
+        }
+        given = 1;
+    }
+    return 0;
+}
+
+
+/* Comma-separated event names, like they are given to --retire. */
+static
+int fput_event_list(short flags, FILE * stream)
+{
+    static struct event const * const end = events + event_count;
+    struct event const * event = events;
+    int first = 1;
+    for(; event < end; event += 1)
+    {
+        if(event->flag & flags)
+        {
+            if((!first && fputc(',', stream) == EOF)
+            || fputs(event->name, stream) == EOF)
+            {
+                return EOF;
+            }
+            first = 0;
+        }
+    }
+    return 0;
+}
+
+
+/* A CLOCK_MONOTONIC time as seconds, with all nine digits after the dot. */
+static
+int fput_nanoseconds(long long time, FILE * stream)
+{
+    char fraction[10];
+    long long part = time % 1000000000;
+    int digit;
+    for(digit = 8; digit >= 0; digit -= 1)
+    {
+        fraction[digit] = part % 10 + '0';
+        part /= 10;
+    }
+    fraction[9] = '\0';
+    if(fput_nonnegative_int(clamp_long_long(time / 1000000000), stream)
+       == EOF
+    || fputc('.', stream) == EOF)
+    {
+        return EOF;
+    }
+    return fputs(fraction, stream);
+}
+
+
+/*\
+Prints a trace record like a result line, after the time of the wake, and
+with the events that were polled for and how long the wait took:
+
+    12345.000000123 3 IN HUP asked=IN waited_us=1500
+\*/
+static
+int fput_trace_record(struct trace_record const * record, FILE * stream)
+{
+    if(fput_nanoseconds(record->time, stream) == EOF
+    || fputc(' ', stream) == EOF
+    || fput_nonnegative_int(record->fd, stream) == EOF
+    || fput_events(record->revents, stream) == EOF
+    || fputs(" asked=", stream) == EOF
+    || fput_event_list(record->events, stream) == EOF
+    || fput_field("waited_us", clamp_long_long(record->waited / 1000),
+                  stream) == EOF)
+    {
+        return EOF;
+    }
+    return fputc('\n', stream);
+}
+
+
+static
+int trace_record_cmp(void const * record1, void const * record2)
+{
+    return ((struct trace_record const *)record1)->fd
+         - ((struct trace_record const *)record2)->fd;
+}
+
+
+/*\
+Prints how often each descriptor had each event, and the longest wait that
+ended with it, and then how many wakes there were over how long:
+
+    3 records=12 IN=12 HUP=1 max_waited_us=20031
+    total records=15 wakes=13 span_us=240113
+\*/
+static
+int fput_trace_summary(struct trace_record const * records, size_t count,
+                       FILE * stream)
+{
+    struct trace_record * sorted = malloc(count * sizeof(*records) + 1);
+    int * counts = calloc(event_count, sizeof(int));
+    long long wakes = 0;
+    size_t index;
+    size_t group;
+    if(!sorted || !counts)
+    {
+        return -2;
+    }
+    for(index = 0; index < count; index += 1)
+    {
+        if(!index || records[index].time != records[index - 1].time)
+        {
+            wakes += 1;
+        }
+    }
+    memcpy(sorted, records, count * sizeof(*records));
+    qsort(sorted, count, sizeof(*records), trace_record_cmp);
+    for(group = 0; group < count; group = index)
+    {
+        long long waited = 0;
+        size_t event;
+        memset(counts, 0, event_count * sizeof(int));
+        for(index = group;
+            index < count && sorted[index].fd == sorted[group].fd;
+            index += 1)
+        {
+            for(event = 0; event < event_count; event += 1)
+            {
+                if(sorted[index].revents & events[event].flag
+                && counts[event] < INT_MAX)
+                {
+                    counts[event] += 1;
+                }
+            }
+            if(sorted[index].waited > waited)
+            {
+                waited = sorted[index].waited;
+            }
+        }
+        if(fput_nonnegative_int(sorted[group].fd, stream) == EOF
+        || fput_field("records", clamp_long_long(index - group), stream)
+           == EOF)
+        {
+            return EOF;
+        }
+        for(event = 0; event < event_count; event += 1)
+        {
+            if(counts[event]
+            && fput_field(events[event].name, counts[event], stream) == EOF)
+            {
+                return EOF;
+            }
+        }
+        if(fput_field("max_waited_us", clamp_long_long(waited / 1000),
+                      stream) == EOF
+        || fputc('\n', stream) == EOF)
+        {
+            return EOF;
+        }
+    }
+    if(fputs("total", stream) == EOF
+    || fput_field("records", clamp_long_long(count), stream) == EOF
+    || fput_field("wakes", clamp_long_long(wakes), stream) == EOF
+    || fput_field("span_us", count ? clamp_long_long(
+                      (records[count - 1].time - records[0].time) / 1000)
+                  : 0, stream) == EOF)
+    {
+        return EOF;
+    }
+    return fputc('\n', stream);
+}
+
+
+/*\
+Prints the records of a trace file, or a summary of them. Zeroed records
+at the end are what is left from a run that didn't get to close the trace,
+so they are left out.
+\*/
+static
+int decode_trace(char const * path, int summary, char * arg0)
+{
+    struct trace_header header;
+    struct stat status;
+    struct trace_record const * records;
+    size_t count;
+    size_t index;
+    char * mapped;
+    int result = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &status) < 0)
+    {
+        return error_opening(path, arg0);
+    }
+    if(read(fd, &header, sizeof(header)) != sizeof(header)
+    || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+    || header.record_size != sizeof(struct trace_record)
+    || (status.st_size - sizeof(header)) % sizeof(struct trace_record))
+    {
+        return error_bad_trace(path, arg0);
+    }
+    mapped = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(mapped == MAP_FAILED)
+    {
+        return error_reading(arg0);
+    }
+    records = (struct trace_record const *)(mapped + sizeof(header));
+    count = (status.st_size - sizeof(header)) / sizeof(struct trace_record);
+    while(count && !records[count - 1].time)
+    {
+        count -= 1;
+    }
+    if(summary)
+    {
+        result = fput_trace_summary(records, count, stdout);
+    }
+    else
+    {
+        for(index = 0; index < count && result != EOF; index += 1)
+        {
+            result = fput_trace_record(records + index, stdout);
+        }
+    }
+    if(result == -2)
+    {
+        return error_allocating_memory(arg0);
+    }
+    if(result == EOF || flush_output(stdout) == EOF)
+    {
+        return error_writing_output(arg0);
+    }
+    return EXIT_ASKED_EVENT_OR_INFO;
+}
+
+
+int main(int argc, char * * argv)
+{
+    char * arg;
+    char * arg0 = *argv;
+    char * timeout_arg = 0;
+    int timeout = -1;  /* default timeout is no timeout */
+    char * min_ready_arg = 0;
+    int min_ready = 0;  /* default is to stop at the first events */
+    int all = 0;
+    struct expression expression = {0, 0, 0};
+    struct stage * stages;
+    unsigned int stage_count = 1;
+    int other_mode;
+    nfds_t nfds;
+    struct child * children;
+    struct child_output * child_outputs;
+    unsigned int child_count = 0;
+    struct race race = {-1, -1};
+    struct sources sources;
+    int info = 0;
+    struct stats stats = {"poll", 1, 0, 0, 0, 0};
+    struct reporting reporting = {0, 0, 0, 0, 0, 0, -1, &stats, 0};
+    struct trace trace;
+    char * trace_path = 0;
+    char * decode_path = 0;
+    int summary = 0;
+    char const * backend = "auto";
+    int print_stats = 0;
+    int exitcode;
+    char * gather_arg = 0;
+    char * debounce_arg = 0;
+    char * max_rate_arg = 0;
+#ifdef LINUX_EXTENSIONS
+    char * threads_arg = 0;
+    int threads = 1;
+#endif
+#ifdef LINUX_EXTENSIONS
+    struct relay relay = {0, DEFAULT_BATCH, 0, 0};
+    struct match match = {0, 0, 0};
+    /* The last option given that only does anything with --relay. */
+    char * relay_option = 0;
+    /* The last option given that only does anything with --until-match. */
+    char * match_option = 0;
+#endif
+
+    if(argc < 2)
+    {
+        if(!arg0)
+        {
+            arg0 = "";
+        }
+        return error_need_descriptor_or_event(arg0);
+    }
+
+    argv += 1;
+    arg = *argv;
+
+    /*\
+    There can't be more children than arguments, and like with polls, the
+    overallocation is small enough to not be worth counting them first.
+    \*/
+    children = calloc(argc, sizeof(struct child));
+    if(!children)
+    {
+        return error_allocating_memory(arg0);
+    }
+
+    while(arg && *arg == '-')
+    {
+        char * value;
+        if(is_flag_option(arg, "help", 'h'))
+        {
+            return print_help(arg0);
+        }
+        if(is_flag_option(arg, "version", 'V'))
+        {
+            return print_version(arg0);
+        }
+
+        if(is_value_option(&argv, "timeout", 't', &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("timeout", arg0);
+            }
+            timeout_arg = value;
+        }
+        else
+        if(is_value_option(&argv, "spawn", 's', &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("spawn", arg0);
+            }
+            children[child_count].command = value;
+            child_count += 1;
+        }
+        else
+        if(is_flag_option(arg, "watch", 'w'))
+        {
+            reporting.watch = 1;
+        }
+        else
+        if(is_flag_option(arg, "info", 'i'))
+        {
+            info = 1;
+        }
+        else
+        if(is_value_option(&argv, "gather", 0, &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("gather", arg0);
+            }
+            gather_arg = value;
+        }
+        else
+        if(is_value_option(&argv, "debounce", 0, &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("debounce", arg0);
+            }
+            debounce_arg = value;
+        }
+        else
+        if(is_value_option(&argv, "max-rate", 0, &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("max-rate", arg0);
+            }
+            max_rate_arg = value;
+        }
+        else
+        if(is_flag_option(arg, "edge", 0))
+        {
+            reporting.edge = 1;
+        }
+        else
+        if(is_value_option(&argv, "control", 0, &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("control", arg0);
+            }
+            if(!parse_nonnegative_int(value, &reporting.control))
+            {
+                return error_bad_option_argument("control", value, arg0);
+            }
+        }
+        else
+        if(is_value_option(&argv, "backend", 0, &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("backend", arg0);
+            }
+            if(strcmp(value, "auto") && strcmp(value, "poll")
+#ifdef LINUX_EXTENSIONS
+            && strcmp(value, "threads")
+#endif
+            )
+            {
+                return error_bad_option_argument("backend", value, arg0);
+            }
+            backend = value;
+        }
+        else
+        if(is_flag_option(arg, "stats", 0))
+        {
+            print_stats = 1;
+        }
+        else
+        if(is_value_option(&argv, "trace", 0, &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("trace", arg0);
+            }
+            trace_path = value;
+        }
+        else
+        if(is_value_option(&argv, "decode-trace", 0, &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("decode-trace", arg0);
+            }
+            decode_path = value;
+        }
+        else
+        if(is_flag_option(arg, "summary", 0))
+        {
+            summary = 1;
+        }
+        else
+        if(is_value_option(&argv, "retire", 0, &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("retire", arg0);
+            }
+            if(!parse_event_list(value, &reporting.retire))
+            {
+                return error_bad_option_argument("retire", value, arg0);
+            }
+        }
+        else
+        if(is_value_option(&argv, "min-ready", 0, &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("min-ready", arg0);
+            }
+            min_ready_arg = value;
+        }
+        else
+        if(is_flag_option(arg, "all", 0))
+        {
+            all = 1;
+        }
+        else
+        if(is_value_option(&argv, "expression", 'e', &value))
+        {
+            int error;
+            if(!value)
+            {
+                return error_need_option_argument("expression", arg0);
+            }
+            error = compile_expression(value, &expression);
+            if(error == -2)
+            {
+                return error_allocating_memory(arg0);
+            }
+            if(error)
+            {
+                return error_bad_option_argument("expression", value, arg0);
+            }
+        }
+#ifdef LINUX_EXTENSIONS
+        else
+        if(is_flag_option(arg, "relay", 'r'))
+        {
+            relay.enabled = 1;
+        }
+        else
+        if(is_value_option(&argv, "batch", 0, &value))
+        {
+            int batch;
+            if(!value)
+            {
+                return error_need_option_argument("batch", arg0);
+            }
+            if(!parse_nonnegative_int(value, &batch)
+            || !batch || batch > MAX_BATCH)
+            {
+                return error_bad_option_argument("batch", value, arg0);
+            }
+            relay.batch = batch;
+            relay_option = "--batch";
+        }
+        else
+        if(is_value_option(&argv, "framing", 0, &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("framing", arg0);
+            }
+            if(!strcmp(value, "length"))
+            {
+                relay.length_framing = 1;
+            }
+            else
+            if(!strcmp(value, "newline"))
+            {
+                relay.length_framing = 0;
+            }
+            else
+            {
+                return error_bad_option_argument("framing", value, arg0);
+            }
+            relay_option = "--framing";
+        }
+        else
+        if(is_flag_option(arg, "address", 0))
+        {
+            relay.with_address = 1;
+            relay_option = "--address";
+        }
+        else
+        if(is_value_option(&argv, "race", 0, &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("race", arg0);
+            }
+            if(!parse_nonnegative_int(value, &race.fd))
+            {
+                return error_bad_option_argument("race", value, arg0);
+            }
+        }
+        else
+        if(is_value_option(&argv, "threads", 0, &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("threads", arg0);
+            }
+            threads_arg = value;
+        }
+        else
+        if(is_value_option(&argv, "until-match", 'm', &value))
+        {
+            if(!value)
+            {
+                return error_need_option_argument("until-match", arg0);
+            }
+            if(!*value || strlen(value) > MAX_LINE)
+            {
+                return error_bad_option_argument("until-match", value, arg0);
+            }
+            match.pattern = value;
+        }
+        else
+        if(is_flag_option(arg, "regex", 0))
+        {
+            match.regex = 1;
+            match_option = "--regex";
+        }
+        else
+        if(is_flag_option(arg, "pass", 0))
+        {
+            match.pass = 1;
+            match_option = "--pass";
+        }
+#endif
+        else
+        {
+            return error_bad_option(arg, arg0);
+        }
+
+        argv += 1;
+        arg = *argv;
+    }
+
+    /* Decoding a trace is a whole other thing to do than waiting. */
+    if(decode_path)
+    {
+        return decode_trace(decode_path, summary, arg0);
+    }
+
+    /*\
+    The children's output is enough to poll for if there are children, and
+    so are the descriptors in an expression. With a control channel, all of
+    them can come later.
+    \*/
+    if(!arg && !child_count && !expression.terms && reporting.control < 0)
+    {
+        return error_need_descriptor_or_event(arg0);
+    }
+
+    if(timeout_arg && !parse_nonnegative_int(timeout_arg, &timeout))
+    {
+        return error_bad_option_argument("timeout", timeout_arg, arg0);
+    }
+
+    if(gather_arg && !parse_nonnegative_int(gather_arg, &reporting.gather))
+    {
+        return error_bad_option_argument("gather", gather_arg, arg0);
+    }
+
+    if(debounce_arg
+    && !parse_nonnegative_int(debounce_arg, &reporting.debounce))
+    {
+        return error_bad_option_argument("debounce", debounce_arg, arg0);
+    }
+
+    if(max_rate_arg
+    && !parse_nonnegative_int(max_rate_arg, &reporting.max_rate))
+    {
+        return error_bad_option_argument("max-rate", max_rate_arg, arg0);
+    }
+
+#ifdef LINUX_EXTENSIONS
+    /* These only change how --relay and --until-match do their thing. */
+    if(relay_option && !relay.enabled)
+    {
+        return error_bad_option(relay_option, arg0);
+    }
+    if(match_option && !match.pattern)
+    {
+        return error_bad_option(match_option, arg0);
+    }
+
+    if(threads_arg && (!parse_nonnegative_int(threads_arg, &threads)
+                       || !threads || threads > MAX_THREADS))
+    {
+        return error_bad_option_argument("threads", threads_arg, arg0);
+    }
+#endif
+
+    if(min_ready_arg
+    && (!parse_nonnegative_int(min_ready_arg, &min_ready) || !min_ready))
+    {
+        return error_bad_option_argument("min-ready", min_ready_arg, arg0);
+    }
+
+    /*\
+    We always poll for at least one FD if we poll at all, plus the stdout
+    and stderr of each child.
+    \*/
+    nfds = argc + child_count * 2 + expression.atoms;
+ 
+    /*\
+    This overallocates in most cases, but it is normal for calloc
+    to overallocate much more internally (one memory page or more).
+    \*/
+    struct pollfd * polls = calloc(nfds, sizeof(struct pollfd));
+    if(!polls)
     {
         return error_allocating_memory(arg0);
     }
  
+    /* Every source takes up an argument, so this also overallocates. */
+    sources.list = calloc(argc, sizeof(struct source));
+    if(!sources.list)
+    {
+        return error_allocating_memory(arg0);
+    }
+    sources.count = 0;
+    /* Every condition takes up an argument too. */
+    sources.conditions = calloc(argc, sizeof(struct condition));
+    if(!sources.conditions)
+    {
+        return error_allocating_memory(arg0);
+    }
+    sources.condition_count = 0;
+    sources.minimum = first_unused_descriptor(argv);
+    sources.inotify = -1;
+    sources.inotify_events = 0;
+    sources.info = info;
+    sigprocmask(SIG_SETMASK, 0, &sources.mask);
+
     /* Now nfds will index into polls and fds */
     nfds = 0;
 
-    polls[0].fd = 0;
- 
-    short flags = 0;
-    nfds_t fdGroup_i = 0;
- 
-    do
+    /* Every stage after the first takes up an argument as well. */
+    stages = calloc(argc, sizeof(struct stage));
+    if(!stages)
     {
-        int fd;
-        if(parse_nonnegative_int(arg, &fd))
+        return error_allocating_memory(arg0);
+    }
+    if(arg)
+    {
+        stage_count = split_stages(argv, stages);
+    }
+
+    /*\
+    Stages, the control channel, and the options for how each wake is
+    reported, are only for plain waiting.
+    \*/
+    other_mode = child_count || race.fd >= 0 || min_ready_arg || all
+              || expression.terms;
+#ifdef LINUX_EXTENSIONS
+    other_mode = other_mode || relay.enabled || match.pattern;
+#endif
+    char * const modes[] =
+    {
+        child_count ? "--spawn" : race.fd >= 0 ? "--race" : 0,
+        min_ready_arg ? "--min-ready" : all ? "--all" : 0,
+        expression.terms ? "--expression" : 0,
+#ifdef LINUX_EXTENSIONS
+        relay.enabled ? "--relay" : 0,
+        match.pattern ? "--until-match" : 0,
+#endif
+    };
+    char * conflict = second_mode(modes, sizeof(modes) / sizeof(*modes));
+    if(conflict)
+    {
+        return error_bad_option(conflict, arg0);
+    }
+    if(reporting.control >= 0 && (other_mode || stage_count > 1))
+    {
+        return error_bad_option("--control", arg0);
+    }
+    if(other_mode && reporting_option(&reporting, print_stats))
+    {
+        return error_bad_option(reporting_option(&reporting, print_stats),
+                                arg0);
+    }
+
+    /* Every wake is traced where it is reported, which other modes do not. */
+    if(trace_path)
+    {
+        int status;
+        if(other_mode)
         {
-            /* If there were flags since the last FD, we need to apply them: */
-            if(flags)
+            return error_bad_option("--trace", arg0);
+        }
+        status = open_trace(trace_path, &trace);
+        if(status == -2)
+        {
+            return error_bad_trace(trace_path, arg0);
+        }
+        if(status == -3)
+        {
+            return error_trace_in_use(trace_path, arg0);
+        }
+        if(status < 0)
+        {
+            return error_opening(trace_path, arg0);
+        }
+        reporting.trace = &trace;
+    }
+#ifdef LINUX_EXTENSIONS
+    if((threads > 1 || !strcmp(backend, "threads"))
+    && (other_mode || stage_count > 1 || reporting.gather
+        || reporting.debounce || reporting.control >= 0))
+    {
+        return error_bad_option("--threads", arg0);
+    }
+    if(threads_arg && !strcmp(backend, "poll"))
+    {
+        return error_bad_option("--threads", arg0);
+    }
+#endif
+
+    /*\
+    Each stage is parsed into the polls right after the ones before it, all
+    before waiting for any of them, so that a mistake in a later stage does
+    not show up only once the earlier ones are done. The other ways of
+    waiting are about a single set of descriptors.
+    \*/
+    if(stage_count > 1)
+    {
+        unsigned int stage;
+        if(other_mode || reporting.watch)
+        {
+            return error_bad_option("--then", arg0);
+        }
+        for(stage = 0; stage < stage_count; stage += 1)
+        {
+            int error = parse_stage(stages + stage, polls + nfds, &sources,
+                                    timeout, arg0);
+            if(error)
             {
-                applyFlagsToFDGroup(flags, &nfds, &fdGroup_i, polls);
-                /* Reset flags for next group. */
-                flags = 0;
+                return error;
             }
-            polls[nfds].fd = fd;
-            nfds += 1;
-            continue;
+            nfds += stages[stage].nfds;
         }
-  
-        short flag = parse_event(arg);
-        if(flag)
+        for(stage = 0; stage < stage_count; stage += 1)
         {
-            flags |= flag;
-            continue;
+            stats.descriptors += stages[stage].nfds;
+        }
+        exitcode = run_stages(stages, stage_count, &sources, &reporting,
+                              arg0);
+        return finish_waiting(exitcode, &reporting, print_stats, arg0);
+    }
+
+    if(arg)
+    {
+        int error = parse_polls(argv, polls, &nfds, &sources, arg0);
+        if(error)
+        {
+            return error;
         }
-  
-        return error_bad_file_descriptor_or_event(arg, arg0);
     }
-    while((arg = *++argv));
-    /* Need to apply flags to last FD group: */
-    applyFlagsToFDGroup(flags, &nfds, &fdGroup_i, polls);
 
-    qsort(polls, nfds, sizeof(struct pollfd), pollfdcmp);
+    add_expression_polls(&expression, polls, &nfds);
 
-    nfds = merge_sorted_polls(polls, nfds);
+    /* The control option's argument makes room for its poll. */
+    if(reporting.control >= 0)
+    {
+        polls[nfds].fd = reporting.control;
+        polls[nfds].events = POLLIN;
+        nfds += 1;
+    }
 
-    int result = poll(polls, nfds, timeout);
-    if(result < 0)
+    nfds = sort_and_merge_polls(polls, nfds);
+
+#ifdef LINUX_EXTENSIONS
+    /*\
+    The children are only started once a connection has won, and the race
+    is all that the timeout is for. The polls of the race are done with by
+    then, so the children's outputs take their place.
+    \*/
+    if(race.fd >= 0)
     {
-        return error_polling(arg0);
+        int exitcode = race_connections(polls, nfds, timeout, &sources,
+                                        &race, arg0);
+        if(race.winner < 0 || !child_count)
+        {
+            return exitcode;
+        }
+        /*\
+        The connect was non-blocking, but the commands get the socket like
+        any other, which they expect to block. Duplicating it onto the same
+        number would leave it close-on-exec.
+        \*/
+        if(clear_descriptor_flag(race.winner, F_GETFL, F_SETFL, O_NONBLOCK)
+           < 0
+        || (race.winner == race.fd && fcntl(race.fd, F_SETFD, 0) < 0))
+        {
+            return error_spawning(children[0].command, arg0);
+        }
+        nfds = 0;
+        timeout = -1;
     }
-    if(!result)
+#endif
+
+    child_outputs = calloc(child_count * 2, sizeof(struct child_output));
+    if(!child_outputs)
     {
-        return EXIT_NO_EVENT;
+        return error_allocating_memory(arg0);
     }
-    int exitcode = EXIT_UNASKED_EVENT;
-    for(; result; polls += 1)
+    for(unsigned int child = 0; child < child_count; child += 1)
     {
-        if(polls->revents)
+        struct child_output * outputs = child_outputs + child * 2;
+        if(spawn_child(children + child, child + 1, &sources, &race,
+                       outputs) < 0)
         {
-            if(fput_result_line(polls->fd, polls->revents, stdout) == EOF)
-            {
-                return error_writing_output(arg0);
-            }
-            if(polls->revents & polls->events)
-            {
-                exitcode = EXIT_ASKED_EVENT_OR_INFO;
-            }
-            result -= 1;
+            return error_spawning(children[child].command, arg0);
         }
+        polls[nfds].fd = outputs[0].fd;
+        polls[nfds].events = POLLIN;
+        polls[nfds + 1].fd = outputs[1].fd;
+        polls[nfds + 1].events = POLLIN;
+        nfds += 2;
     }
-    return exitcode;
+
+    /* The children have their own copies of the winning connection now. */
+    if(race.winner >= 0)
+    {
+        close(race.winner);
+    }
+
+    if(child_count)
+    {
+        return run_children(polls, nfds, timeout, &sources,
+                            children, child_count, child_outputs, arg0);
+    }
+
+#ifdef LINUX_EXTENSIONS
+    if(match.pattern)
+    {
+        return wait_for_match(polls, nfds, timeout, &sources, &match, arg0);
+    }
+
+    if(relay.enabled)
+    {
+        return relay_datagrams(polls, nfds, timeout, &sources, &relay,
+                               arg0);
+    }
+#endif
+
+    /* Only now that duplicates are merged do we know how many there are. */
+    if(all)
+    {
+        min_ready = nfds;
+    }
+    if((nfds_t)min_ready > nfds)
+    {
+        return error_bad_option_argument("min-ready", min_ready_arg, arg0);
+    }
+    if(min_ready)
+    {
+        return wait_for_quorum(polls, nfds, timeout, &sources, min_ready,
+                               arg0);
+    }
+
+    if(expression.terms)
+    {
+        return wait_for_expression(polls, nfds, timeout, &sources,
+                                   &expression, arg0);
+    }
+
+    stats.descriptors = nfds;
+
+#ifndef LINUX_EXTENSIONS
+    /* Without threads, poll itself is the only backend. */
+    (void)backend;
+#endif
+
+#ifdef LINUX_EXTENSIONS
+    /*\
+    Sources and conditions keep state that several threads can't share, and
+    threads don't gather, debounce or read the control channel, so with any
+    of those, waiting is left to poll itself unless threads were asked for.
+    \*/
+    if(!threads_arg && strcmp(backend, "poll")
+    && !sources.count && !sources.condition_count
+    && !reporting.gather && !reporting.debounce && reporting.control < 0)
+    {
+        threads = choose_threads(nfds, reporting.watch,
+                                 !strcmp(backend, "threads"));
+    }
+    if(threads > 1 || !strcmp(backend, "threads"))
+    {
+        if(sources.count || sources.condition_count)
+        {
+            return error_bad_option("--threads", arg0);
+        }
+        stats.backend = "threads";
+        exitcode = wait_in_threads(polls, nfds, timeout, &sources,
+                                   &reporting, threads, arg0);
+    }
+    else
+#endif
+    exitcode = wait_and_report(polls, nfds, timeout, &sources, &reporting,
+                               arg0);
+    return finish_waiting(exitcode, &reporting, print_stats, arg0);
 }